@@ -0,0 +1,384 @@
+// ------------------------------------------------------------------------------------------------|
+//
+// TurboPipe - Standalone throughput benchmark of the core, without Python, ModernGL or a GPU
+//
+// (c) 2024, Tremeschin, MIT License
+//
+// Build with `meson setup build -Dbench=true`, run `build/turbopipe-bench --help`
+//
+// ------------------------------------------------------------------------------------------------|
+
+#define TURBOPIPE_NO_PYTHON
+#include "_turbopipe.cpp"
+
+#include <arpa/inet.h>
+#include <algorithm>
+#include <csignal>
+#include <sstream>
+
+// ------------------------------------------------------------------------------------------------|
+// Cases
+
+struct Case {
+    string target;
+    size_t size;
+    string label;
+    size_t buffers;
+    size_t fds;
+    string backend;
+    size_t width;
+    size_t height;
+};
+
+struct Result {
+    double seconds;
+    size_t frames;
+    size_t bytes;
+    double p50;       // Microseconds per pipe()
+    double p99;
+    double syscalls;  // Write syscalls per frame and fd
+    size_t dropped;   // Frames and fds discarded by the queue policy
+    Options effective; // After fallbacks, such as io_uring being unavailable
+    int error;
+};
+
+static vector<string> split(const string& text, char separator) {
+    vector<string> parts;
+    stringstream stream(text);
+    string part;
+    while (getline(stream, part, separator))
+        if (!part.empty())
+            parts.push_back(part);
+    return parts;
+}
+
+// Frame sizes as WIDTHxHEIGHTxCOMPONENTS or plain bytes
+static bool frame(const string& text, size_t& size, size_t& width, size_t& height) {
+    vector<string> parts = split(text, 'x');
+    size = 1;
+    for (const string& part: parts) {
+        char* end;
+        unsigned long long value = strtoull(part.c_str(), &end, 10);
+        if (*end != '\0' || value == 0)
+            return false;
+        size *= value;
+    }
+    width  = (parts.size() == 3 ? strtoull(parts[0].c_str(), nullptr, 10) : 0);
+    height = (parts.size() == 3 ? strtoull(parts[1].c_str(), nullptr, 10) : 0);
+    return !parts.empty();
+}
+
+// Backends are options joined by '+', such as "ring+splice" or "uring+lz4"
+static bool backend(const string& text, Options& options) {
+    for (const string& name: split(text, '+')) {
+        if (name == "thread" || name == "pwrite")
+            continue;
+        else if (codec(name.c_str(), options.compress))
+            continue;
+        else if (policy(name.c_str(), options.policy))
+            continue;
+        else if (name != "none" && framing(name.c_str(), options.framing))
+            continue;
+        else if (name == "ring")
+            options.ring = 16;
+        else if (name == "splice")
+            options.splice = true;
+        else if (name == "uring")
+            options.uring = true;
+        else if (name == "zerocopy")
+            options.zerocopy = true;
+        else if (name == "direct")
+            options.direct = true;
+        else
+            return false;
+    }
+    return true;
+}
+
+// ------------------------------------------------------------------------------------------------|
+// Targets
+
+// Reads everything written to a descriptor until the other end closes
+static void drain(int file) {
+    vector<char> buffer(1 << 20);
+    while (true) {
+        ssize_t got = read(file, buffer.data(), buffer.size());
+        if (got == 0 || (got < 0 && errno != EINTR))
+            break;
+    }
+    ::close(file);
+}
+
+// A connected loopback TCP pair, the reading end is returned in peer
+static int connected(int& peer) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (listener < 0
+        || ::bind(listener, (sockaddr*) &address, length) != 0
+        || ::listen(listener, 1) != 0
+        || getsockname(listener, (sockaddr*) &address, &length) != 0
+    ) {
+        if (listener >= 0)
+            ::close(listener);
+        return -1;
+    }
+    int file = socket(AF_INET, SOCK_STREAM, 0);
+    if (file >= 0 && connect(file, (sockaddr*) &address, length) != 0) {
+        ::close(file);
+        file = -1;
+    }
+    peer = (file >= 0 ? accept(listener, nullptr, nullptr) : -1);
+    ::close(listener);
+    if (peer < 0 && file >= 0) {
+        ::close(file);
+        file = -1;
+    }
+    return file;
+}
+
+// Opens a writable descriptor of some kind, readers are drained by threads
+static int output(const string& target, vector<thread>& drains) {
+    if (target == "null")
+        return ::open("/dev/null", O_WRONLY);
+
+    if (target == "file") {
+        const char* directory = getenv("TMPDIR");
+        string path = string(directory ? directory : "/tmp") + "/turbopipe-bench-XXXXXX";
+        int file = mkstemp(&path[0]);
+        if (file >= 0)
+            unlink(path.c_str());
+        return file;
+    }
+
+    int ends[2];
+    if (target == "pipe") {
+        if (::pipe(ends) != 0)
+            return -1;
+        drains.emplace_back(drain, ends[0]);
+        return ends[1];
+    }
+    if (target == "socket") {
+        int file = connected(ends[0]);
+        if (file >= 0)
+            drains.emplace_back(drain, ends[0]);
+        return file;
+    }
+    return -1;
+}
+
+// ------------------------------------------------------------------------------------------------|
+// Running
+
+static Result run(const Case& test, size_t traffic, bool copy, Format from, Format into) {
+    Result result = {};
+    Options options;
+    backend(test.backend, options);
+
+    // Positional writes at each frame's offset, by the writer threads
+    bool positional = (("+" + test.backend + "+").find("+pwrite+") != string::npos);
+    size_t stride = (into != Format::None ? converted(from, into, test.width, test.height) : test.size);
+
+    TurboPipe turbopipe;
+    vector<thread> drains;
+    vector<int> files;
+    for (size_t index=0; index<test.fds; index++) {
+        int file = output(test.target, drains);
+        if (file < 0) {
+            result.error = errno;
+            break;
+        }
+        files.push_back(file);
+        result.effective = turbopipe.configure(file, options);
+    }
+
+    // Distinct, touched buffers, the same one blocks until written
+    vector<vector<char>> buffers(test.buffers, vector<char>(test.size));
+    for (size_t index=0; index<buffers.size(); index++)
+        memset(buffers[index].data(), (int) index, test.size);
+
+    size_t frames = max(traffic / (test.size * test.fds), (size_t) 8);
+    vector<double> latencies;
+    latencies.reserve(frames);
+
+    auto start = chrono::steady_clock::now();
+    for (size_t index=0; index<frames && !result.error; index++) {
+        Work work;
+        work.data = buffers[index % buffers.size()].data();
+        work.size = test.size;
+        work.from = from;
+        work.into = into;
+        work.width = test.width;
+        work.height = test.height;
+        if (positional)
+            work.offset = (int64_t) (index * stride);
+        auto queued = chrono::steady_clock::now();
+        result.error = turbopipe._pipe(work, files, copy);
+        latencies.push_back(Stats::since(queued) / 1e3);
+    }
+    if (!result.error)
+        result.error = turbopipe._sync();
+    result.seconds = (Stats::since(start) / 1e9);
+
+    uint64_t writes = 0;
+    uint64_t dropped = 0;
+    for (auto& pair: turbopipe.active()) {
+        writes += pair.second->stats.writes.load();
+        dropped += pair.second->stats.dropped.load();
+    }
+    turbopipe.close();
+
+    for (int file: files)
+        ::close(file);
+    for (thread& reader: drains)
+        reader.join();
+
+    result.frames = latencies.size();
+    result.dropped = dropped;
+    result.bytes = ((result.frames * test.fds - min((size_t) dropped, result.frames * test.fds)) * test.size);
+    result.syscalls = (writes / (double) max(result.frames * test.fds, (size_t) 1));
+    if (!latencies.empty()) {
+        sort(latencies.begin(), latencies.end());
+        result.p50 = latencies[latencies.size() / 2];
+        result.p99 = latencies[min(latencies.size() * 99 / 100, latencies.size() - 1)];
+    }
+    return result;
+}
+
+static void usage() {
+    printf(
+        "Usage: turbopipe-bench [options], comma separated lists run every combination\n"
+        "  --targets LIST   null, pipe, file, socket (default all)\n"
+        "  --sizes LIST     WIDTHxHEIGHTxCOMPONENTS or bytes (default 1280x720x3,1920x1080x3,3840x2160x4)\n"
+        "  --buffers LIST   Distinct buffers cycled through (default 1,4)\n"
+        "  --fds LIST       Descriptors each frame is piped to (default 1,4)\n"
+        "  --backends LIST  thread, ring, splice, uring, zerocopy, pwrite, direct, a codec, queue\n"
+        "                   policy or framing, joined with '+' (default thread)\n"
+        "  --traffic MB     Bytes written per case (default 256)\n"
+        "  --copy           Pipe with copy=True, through staging blocks\n"
+        "  --convert A->B   Convert frames like pipe(convert=...), sizes must be WIDTHxHEIGHTxCOMPONENTS\n"
+        "  --json           One JSON object per case and line, for tracking over time\n"
+    );
+}
+
+int main(int argc, char** argv) {
+    vector<string> targets = {"null", "pipe", "file", "socket"};
+    vector<string> sizes = {"1280x720x3", "1920x1080x3", "3840x2160x4"};
+    vector<string> buffers = {"1", "4"};
+    vector<string> fds = {"1", "4"};
+    vector<string> backends = {"thread"};
+    size_t traffic = (256 << 20);
+    Format from = Format::None;
+    Format into = Format::None;
+    bool copy = false;
+    bool json = false;
+
+    for (int index=1; index<argc; index++) {
+        string flag = argv[index];
+        bool valued = (index + 1 < argc);
+        if (flag == "--targets" && valued)
+            targets = split(argv[++index], ',');
+        else if (flag == "--sizes" && valued)
+            sizes = split(argv[++index], ',');
+        else if (flag == "--buffers" && valued)
+            buffers = split(argv[++index], ',');
+        else if (flag == "--fds" && valued)
+            fds = split(argv[++index], ',');
+        else if (flag == "--backends" && valued)
+            backends = split(argv[++index], ',');
+        else if (flag == "--traffic" && valued)
+            traffic = (strtoull(argv[++index], nullptr, 10) << 20);
+        else if (flag == "--copy")
+            copy = true;
+        else if (flag == "--convert" && valued) {
+            string conversion = argv[++index];
+            size_t arrow = conversion.find("->");
+            if (arrow != string::npos) {
+                from = format(conversion.substr(0, arrow).c_str());
+                into = format(conversion.c_str() + arrow + 2);
+            }
+            if (from == Format::None || into == Format::None) {
+                fprintf(stderr, "Invalid conversion: %s\n", conversion.c_str());
+                return 2;
+            }
+        }
+        else if (flag == "--json")
+            json = true;
+        else {
+            usage();
+            return (flag == "--help" ? 0 : 2);
+        }
+    }
+
+    // Every combination, rejecting bad values before running any
+    vector<Case> cases;
+    for (const string& target: targets)
+    for (const string& label: sizes)
+    for (const string& count: buffers)
+    for (const string& fan: fds)
+    for (const string& name: backends) {
+        Case test = {target, 0, label, strtoull(count.c_str(), nullptr, 10),
+            strtoull(fan.c_str(), nullptr, 10), name, 0, 0};
+        Options options;
+        bool valid = (frame(label, test.size, test.width, test.height) && test.buffers && test.fds
+            && backend(name, options)
+            && (target == "null" || target == "pipe" || target == "file" || target == "socket"));
+
+        // Conversions need the whole frame in the source layout
+        if (valid && from != Format::None) {
+            size_t components = (from == Format::RGBA ? 4 : 3);
+            valid = (converted(from, into, test.width, test.height) > 0
+                && test.size == (test.width * test.height * components));
+        }
+
+        // Y4M streams are yuv420p frames of a fixed size
+        if (valid && options.framing == Framing::Y4M) {
+            size_t chroma = ((test.width + 1) / 2) * ((test.height + 1) / 2);
+            valid = (into == Format::YUV420P
+                || (into == Format::None && test.size == (test.width * test.height + 2 * chroma)));
+        }
+        if (!valid) {
+            fprintf(stderr, "Invalid case: %s %s %s %s %s\n", target.c_str(), label.c_str(),
+                count.c_str(), fan.c_str(), name.c_str());
+            return 2;
+        }
+        cases.push_back(test);
+    }
+
+    // Closed readers are reported as EPIPE, not a signal
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!json)
+        printf("%-7s %-12s %7s %4s %-14s %8s %9s %9s %9s\n",
+            "target", "size", "buffers", "fds", "backend", "GB/s", "p50 us", "p99 us", "syscalls");
+
+    int failures = 0;
+    for (const Case& test: cases) {
+        Result result = run(test, traffic, copy, from, into);
+        double speed = (result.bytes / max(result.seconds, 1e-9) / 1e9);
+        failures += (result.error != 0);
+
+        if (json) {
+            printf("{\"target\": \"%s\", \"size\": \"%s\", \"frame_bytes\": %zu, \"buffers\": %zu, \"fds\": %zu, "
+                "\"backend\": \"%s\", \"copy\": %s, \"frames\": %zu, \"seconds\": %.6f, \"gb_per_s\": %.4f, "
+                "\"p50_us\": %.3f, \"p99_us\": %.3f, \"syscalls_per_frame\": %.4f, \"ring\": %zu, "
+                "\"splice\": %s, \"uring\": %s, \"zerocopy\": %s, \"compress\": \"%s\", \"policy\": \"%s\", "
+                "\"framing\": \"%s\", \"dropped\": %zu, \"error\": %d}\n",
+                test.target.c_str(), test.label.c_str(), test.size, test.buffers, test.fds,
+                test.backend.c_str(), (copy ? "true" : "false"), result.frames, result.seconds, speed,
+                result.p50, result.p99, result.syscalls, result.effective.ring,
+                (result.effective.splice ? "true" : "false"), (result.effective.uring ? "true" : "false"),
+                (result.effective.zerocopy ? "true" : "false"), codec(result.effective.compress),
+                policy(result.effective.policy), framing(result.effective.framing), result.dropped, result.error);
+        } else {
+            printf("%-7s %-12s %7zu %4zu %-14s %8.2f %9.1f %9.1f %9.2f%s%s\n",
+                test.target.c_str(), test.label.c_str(), test.buffers, test.fds, test.backend.c_str(),
+                speed, result.p50, result.p99, result.syscalls,
+                (result.error ? "  " : ""), (result.error ? strerror(result.error) : ""));
+        }
+        fflush(stdout);
+    }
+    return (failures ? 1 : 0);
+}
@@ -128,7 +128,7 @@ class Benchmark:
 
     def run(self):
         for (width, height) in (HD, FHD, QHD, UHD):
-            for test_case in "ABCD":
+            for test_case in "ABCDE":
                 for index, method in enumerate(Methods):
 
                     # Selective x264 presets
@@ -139,6 +139,9 @@ class Benchmark:
                     else:
                         X264 = None
 
+                    # Wait for each frame to be written (sync latency)
+                    SYNC = (test_case == "E")
+
                     # Test constants for fairness
                     nbuffer = (4 if test_case in ["B", "C", "D"] else 1)
                     buffers = [ctx.buffer(data=numpy.random.randint(128, 135, (height, width, 3), dtype=numpy.uint8)) for _ in range(nbuffer)]
@@ -161,8 +164,12 @@ class Benchmark:
 
                                 if method == Methods.TURBOPIPE:
                                     turbopipe.pipe(buffer, process.stdin.fileno())
+                                    if SYNC:
+                                        turbopipe.sync()
                                 else:
                                     process.stdin.write(buffer.read())
+                                    if SYNC and (method == Methods.PYTHON_THREADED):
+                                        process.stdin._queue.join()
 
                                 statistics.next()
 
@@ -178,6 +185,7 @@ class Benchmark:
                         'Test': f"{method.value} {height}p",
                         'x264': (X264 or "Null"),
                         'Buffers': nbuffer,
+                        'Sync': ("Frame" if SYNC else None),
                         'Framerate': f"{int(statistics.average_fps)} fps",
                         'Bandwidth': f"{statistics.average_bps / 1e9:.2f} GB/s",
                         'Gain': (f"{gain:.2f}%" if index != 0 else None)
@@ -1,48 +1,549 @@
-from typing import Optional, Union
+import asyncio
+import os
+import weakref
+from collections import deque
+from fractions import Fraction
+from typing import Deque, Dict, Iterable, List, Optional, Union
 
-from moderngl import Buffer
+from moderngl import Buffer, Framebuffer
 
 from turbopipe import _turbopipe
 
+# File descriptor of the writes to paths, for `configure()` and `stats()`
+PATHS: int = -1
+
 __all__ = [
+    "Pipe",
     "pipe",
+    "pipe_to_path",
+    "PATHS",
     "sync",
+    "pipe_async",
+    "sync_async",
+    "FramebufferPipe",
+    "configure",
+    "stats",
     "close"
 ]
 
-def pipe(buffer: Union[Buffer, memoryview], fileno: int) -> None:
+class Pipe:
     """
-    Pipe the content of a moderngl.Buffer or memoryview to a file descriptor, fast, threaded and
-    blocking when needed. Call `sync(buffer)` before this, and `sync()` when done for
+    An independent TurboPipe, with its own workers, options, stats and completions. The module
+    functions use a default one, `close()` of a Pipe only affects the file descriptors it wrote
 
     Usage:
         ```python
-        # Assuming `buffer = ctx.buffer(...)`
-        # Note: Use as `fbo.read_into(buffer)`
+        # Each render job with its own encoders
+        output = turbopipe.Pipe()
+        output.configure(ffmpeg.stdin.fileno(), depth=8)
+        output.pipe(buffer, ffmpeg.stdin.fileno())
+        output.close()
+        ```
+    """
+
+    def __init__(self, _native=None):
+        self._native = (_native or _turbopipe.Pipe())
+
+        # Futures of tracked pipes by ticket, and whether each loop watches the notifier fd
+        self._futures: Dict[int, asyncio.Future] = {}
+        self._early: Dict[int, int] = {}
+        self._loops: "weakref.WeakKeyDictionary[asyncio.AbstractEventLoop, bool]" = weakref.WeakKeyDictionary()
+
+    def __enter__(self) -> "Pipe":
+        return self
+
+    def __exit__(self, *args) -> None:
+        self.close()
+
+    def pipe(self,
+        buffer: Union[Buffer, memoryview, bytes, bytearray],
+        fileno: Union[int, Iterable[int]],
+        copy: bool=False,
+        convert: Optional[str]=None,
+        width: Optional[int]=None,
+        height: Optional[int]=None,
+        flip: bool=False,
+        repeat: int=1,
+        offset: Optional[int]=None,
+        pts: Optional[int]=None,
+    ) -> None:
+        """
+        Pipe the content of a moderngl.Buffer or any contiguous buffer protocol object (memoryview,
+        bytearray, numpy arrays, mmap...) to a file descriptor, fast, threaded and blocking when
+        needed. Call `sync(buffer)` before this, and `sync()` when done for. A reference is held
+        until written, temporaries can be piped and forgotten, the memory must not change meanwhile.
+        Buffers are mapped and unmapped by this thread, owning the OpenGL context, and not held
+
+        Raises the OSError of a previous failed write to this file descriptor (eg. BrokenPipeError
+        when FFmpeg died), all later pipes to it fail fast until `close()`. Others still get it when
+        piping to many, and `sync(buffer)` waits for all of them
+
+        Args:
+            copy: Queue a copy of the buffer in a staging block owned by TurboPipe, the buffer can
+                be reused as soon as this returns, no `sync(buffer)` needed. Blocks while all the
+                fd's staging blocks are queued, see `configure(staging=...)`
+            convert: Pixel format conversion done by the writer thread, as "from->into", one of
+                "rgba->rgb", "rgb->yuv420p", "rgba->yuv420p", "rgb->nv12" or "rgba->nv12". YUV is
+                BT.601 limited range, FFmpeg's default, match its `-pix_fmt` to the output format
+            width: Frame width in pixels, required for conversions
+            height: Frame height in pixels, required for conversions and flipping
+            flip: Write the rows bottom-up, as OpenGL reads framebuffers, instead of FFmpeg's
+                `-vf vflip`. Free as reordered writes, or done while converting
+            repeat: Write the frame this many times in a row, for still stretches of a video. Pipes
+                get a single copy in the kernel duplicated with `tee()` on Linux, spread over up to 64
+                private pipes of `/proc/sys/fs/pipe-max-size` each (1 MB by default). All files share
+                a quarter of `/proc/sys/fs/pipe-user-pages-soft` for them, only one per file is kept
+                between frames. Larger frames and other files write the memory again
+            offset: Write at this byte offset of a regular file with `pwrite`, by a few writer
+                threads in parallel and in any order, not the fd's ordered stream. Never compressed,
+                see `configure(writers=..., direct=...)`
+            pts: Timestamp of the frame in the caller's time base, carried by length framed
+                headers for variable frame rates, see `configure(framing=...)`. Repeats share it
+
+        Usage:
+            ```python
+            # Assuming `buffer = ctx.buffer(...)`
+            # Note: Use as `fbo.read_into(buffer)`
+
+            # As a open() file
+            with open("file.bin", "wb") as file:
+                turbopipe.pipe(buffer, file.fileno())
+
+            # As a subprocess
+            child = subprocess.Popen(..., stdin=subprocess.PIPE)
+            turbopipe.pipe(buffer, child.stdin.fileno())
+
+            # Same buffer to many, written in parallel
+            turbopipe.pipe(buffer, (encoder.stdin.fileno(), preview.stdin.fileno()))
+            ```
+        """
+        hold = (not isinstance(buffer, Buffer))
+        if not hold:
+            buffer = memoryview(buffer.mglo)
+        if not isinstance(fileno, int):
+            fileno = tuple(fileno)
+        self._native.pipe(
+            buffer, fileno,
+            hold=hold,
+            copy=copy,
+            convert=convert,
+            width=(width or 0),
+            height=(height or 0),
+            flip=flip,
+            repeat=repeat,
+            offset=(-1 if (offset is None) else offset),
+            pts=(-1 if (pts is None) else pts),
+        )
+
+    def pipe_to_path(self,
+        buffer: Union[Buffer, memoryview, bytes, bytearray],
+        path: Union[str, os.PathLike],
+        index: Optional[int]=None,
+        copy: bool=False,
+        convert: Optional[str]=None,
+        width: Optional[int]=None,
+        height: Optional[int]=None,
+        flip: bool=False,
+    ) -> None:
+        """
+        Pipe a buffer into a new file, created or truncated, for image sequences and raw frame
+        caches. Writer threads open, `pwrite` and close many files in parallel, their stats and
+        options are those of the `turbopipe.PATHS` file descriptor, as in `configure(PATHS, ...)`
+
+        Args:
+            path: The file's path, or a printf-style template formatted with the index
+            index: Frame number of a template like "frame%05d.raw", None if the path is final
+            copy, convert, width, height, flip: As in `pipe()`
+
+        Usage:
+            ```python
+            for index in range(frames):
+                turbopipe.pipe_to_path(buffer, "render/frame%05d.rgb", index, copy=True)
+            turbopipe.sync()
+            ```
+        """
+        path = os.fspath(path)
+        if (index is not None):
+            path = (path % index)
+        hold = (not isinstance(buffer, Buffer))
+        if not hold:
+            buffer = memoryview(buffer.mglo)
+        self._native.pipe(
+            buffer, PATHS,
+            hold=hold,
+            copy=copy,
+            convert=convert,
+            width=(width or 0),
+            height=(height or 0),
+            flip=flip,
+            path=path,
+        )
+
+    def sync(self, buffer: Optional[Union[Buffer, memoryview, bytes, bytearray]]=None) -> None:
+        """
+        Waits for any pending write operation on a buffer, or 'all buffers' if None, to finish.
+        Raises the OSError of a failed write of that buffer, once, or of any write if None, the
+        data might not have been fully written
+        """
+        if isinstance(buffer, Buffer):
+            buffer = memoryview(buffer.mglo)
+        self._native.sync(buffer)
+
+    def _complete(self) -> None:
+        for (ticket, error) in self._native.completed():
+            future = self._futures.pop(ticket, None)
+            if (future is None):
+                self._early[ticket] = error
+                continue
+            self._finish(future, error)
+
+    def _finish(self, future: asyncio.Future, error: int) -> None:
+        if error:
+            result = (future.set_exception, OSError(error, os.strerror(error)))
+        else:
+            result = (future.set_result, None)
+        future.get_loop().call_soon_threadsafe(self._resolve, future, *result)
+
+    def _resolve(self, future: asyncio.Future, method, value) -> None:
+        if not future.done():
+            method(value)
+
+    def _poll(self, loop: asyncio.AbstractEventLoop) -> None:
+        self._complete()
+        if any((future.get_loop() is loop) for future in self._futures.values()):
+            loop.call_later(0.001, self._poll, loop)
+        else:
+            self._loops.pop(loop, None)
+
+    def _watch(self, loop: asyncio.AbstractEventLoop) -> None:
+        if (loop in self._loops):
+            return
+        file = self._native.notifier()
+        try:
+            if (file < 0):
+                raise NotImplementedError
+            loop.add_reader(file, self._complete)
+            self._loops[loop] = True
+
+        # Windows' proactor loops can't watch file descriptors, poll them instead
+        except NotImplementedError:
+            self._loops[loop] = False
+            loop.call_soon(self._poll, loop)
+
+    def pipe_async(self,
+        buffer: Union[Buffer, memoryview, bytes, bytearray],
+        fileno: Union[int, Iterable[int]],
+        **options,
+    ) -> asyncio.Future:
+        """
+        Same as `pipe()` within a running event loop, returning a future completed once the buffer
+        was written to all file descriptors, or failed with their OSError. No thread waits on it,
+        the workers signal a file descriptor the loop watches. Awaiting it replaces `sync(buffer)`
 
-        # As a open() file
-        with open("file.bin", "wb") as file:
-            turbopipe.pipe(buffer, file.fileno())
+        Note: Queueing might still block as `pipe()` does, when the same buffer is pending or
+        the queue is full, prefer `copy=True` and enough `configure(staging=...)` blocks
 
-        # As a subprocess
-        child = subprocess.Popen(..., stdin=subprocess.PIPE)
-        turbopipe.pipe(buffer, child.stdin.fileno())
+        Usage:
+            ```python
+            # Many frames in flight, awaited later
+            futures = [turbopipe.pipe_async(buffer, fileno, copy=True) for buffer in buffers]
+            await asyncio.gather(*futures)
+            ```
+        """
+        loop = asyncio.get_running_loop()
+        self._watch(loop)
+        options["hold"] = (not isinstance(buffer, Buffer))
+        if not options["hold"]:
+            buffer = memoryview(buffer.mglo)
+        if not isinstance(fileno, int):
+            fileno = tuple(fileno)
+        for (key, value) in (("width", 0), ("height", 0), ("offset", -1), ("pts", -1)):
+            if options.get(key) is None:
+                options[key] = value
+        ticket = self._native.pipe(buffer, fileno, track=True, **options)
+        future = loop.create_future()
+        self._futures[ticket] = future
+
+        # Another loop's reader might have drained it before the future existed
+        if ticket in self._early:
+            self._finish(self._futures.pop(ticket), self._early.pop(ticket))
+        return future
+
+    async def sync_async(self) -> None:
+        """Waits for all `pipe_async()` of this loop to complete, raising the first OSError"""
+        loop = asyncio.get_running_loop()
+        pending = [future for future in self._futures.values() if (future.get_loop() is loop)]
+        if pending:
+            await asyncio.gather(*pending)
+
+    def configure(self,
+        fileno: int,
+        ring: Optional[int]=None,
+        chunk: Optional[int]=None,
+        iovecs: Optional[int]=None,
+        pipesize: Optional[int]=None,
+        splice: Optional[bool]=None,
+        depth: Optional[int]=None,
+        memory: Optional[int]=None,
+        staging: Optional[int]=None,
+        copiers: Optional[int]=None,
+        compress: Optional[str]=None,
+        level: Optional[int]=None,
+        compressors: Optional[int]=None,
+        nodelay: Optional[bool]=None,
+        sndbuf: Optional[int]=None,
+        zerocopy: Optional[bool]=None,
+        uring: Optional[bool]=None,
+        cpus: Optional[Iterable[int]]=None,
+        priority: Optional[int]=None,
+        hugepages: Optional[bool]=None,
+        policy: Optional[str]=None,
+        writers: Optional[int]=None,
+        direct: Optional[bool]=None,
+        framing: Optional[str]=None,
+        fps: Optional[Union[int, float, str, Fraction]]=None,
+    ) -> dict:
+        """
+        Set options of a file descriptor, only the given ones change. Waits for its queued writes to
+        finish first, and applies until `close()`. Returns the effective options
+
+        Args:
+            ring: Use a lock-free queue of this many frames (rounded up to a power of two) instead
+                of the locked one, cheaper for many small frames. Zero for the locked queue (default)
+            chunk: Maximum bytes per write syscall. Zero adapts it to the destination, doubling
+                while writes complete fully and halving on partial ones, from 4 KB to 16 MB (default)
+            iovecs: Maximum queued frames sent on a single vectored write (default 16)
+            pipesize: Linux only, grow the buffer of pipes up to this many bytes, for fewer context
+                switches with the reader. Zero for `/proc/sys/fs/pipe-max-size` (default), negative
+                to keep it. Pipes are resized when first seen, the result has their actual capacity.
+                On Windows pipes are sized by their creator (`CreatePipe`), the result only reports it
+            splice: Linux only, map the buffer's pages into pipes with `vmsplice` instead of copying
+                them. A buffer is only synced once the reader consumed it from the pipe, so this fd
+                must be the pipe's only writer (default False, ignored if not a pipe)
+            depth: Maximum frames queued or being written, `pipe()` blocks past it. Zero for
+                unlimited (default), only the same buffer being queued twice blocks
+            memory: Maximum bytes queued or being written, `pipe()` blocks past it, a single
+                larger frame is still accepted. Zero for unlimited (default)
+            staging: Number of page aligned blocks reused for `pipe(copy=True)`, each as large as
+                the biggest frame, bounding the memory used for copies (default 4)
+            copiers: Threads sharing the copy of frames over 4 MB into staging blocks, done with
+                cache bypassing SIMD stores. Zero picks up to 4 by the CPU count (default)
+            compress: Compress every frame with "lz4" or "zstd" when built with them (liblz4,
+                libzstd), for regular files or sockets rather than encoders, "none" to disable.
+                Frames are split in 1 MB blocks, each with a header of two little endian uint32,
+                its size and packed size (equal if stored as is), an empty block ends the frame
+            level: Compression level, LZ4's acceleration or zstd's level. Zero for the fastest
+            compressors: Threads compressing the blocks of a frame. Zero picks up to 4 by the
+                CPU count (default)
+            nodelay: Set TCP_NODELAY on TCP sockets, frames don't benefit from Nagle's algorithm
+                delaying small segments (default True). Sockets are always written with send()
+            sndbuf: Send buffer bytes of sockets, zero keeps the kernel's autotuning (default), the
+                result has the size in effect (Linux doubles it for bookkeeping)
+            zerocopy: Linux only, send the buffer's pages with `MSG_ZEROCOPY`. Like splice, a buffer
+                is only synced once the kernel notifies it's done with them (default False, ignored
+                if not a socket or unsupported)
+            uring: Linux only, write this fd from a single io_uring thread shared by all fds asking
+                for it, instead of a thread of its own. Better with dozens of outputs. Falls back to
+                a thread if io_uring is unavailable, or when compressing (default False)
+            cpus: Pin the fd's worker thread to these CPUs, eg. the NUMA node of the GPU and the
+                encoder, and first touch new staging blocks from them so their memory is local to
+                it. Empty for any CPU (default). Linux and Windows (first 64 CPUs), not io_uring's
+            priority: Nice value of the worker thread, from -20 to 19, raising it needs privileges
+                and fails silently otherwise. Zero keeps the process' one (default). Windows maps it
+                to thread priority levels
+            hugepages: Linux only, back staging blocks with huge pages for fewer TLB misses on
+                large frames, reserved ones (`MAP_HUGETLB`) if any, else transparent ones
+                (default False)
+            policy: What `pipe()` does with queued frames not yet being written instead of
+                blocking, for realtime targets where a late frame is worse than a lost one.
+                "fifo" writes them all (default), "drop_oldest" replaces a still queued same buffer
+                and discards the oldest ones to stay within depth and memory, "latest_only" keeps
+                only the newest. Discarded frames complete as if written and count in stats, uses
+                the locked queue over ring
+            writers: Threads doing the positional writes of `pipe(offset=...)` in parallel, or
+                of `pipe_to_path()` for `PATHS`, started with the first one (default 4)
+            direct: Linux only, positional writes skip the page cache with `O_DIRECT` when the
+                memory, size and offset are multiples of 4 KB, as staging blocks are. For frames
+                that won't be read back soon (default False)
+            framing: Headers written with every frame in the same vectored write, so readers
+                find frame boundaries without knowing the size. "none" for raw frames (default),
+                "y4m" for a YUV4MPEG2 stream FFmpeg reads with `-f yuv4mpegpipe`, of yuv420p frames
+                as converted or given, with width and height, all of the first frame's size and
+                never compressed, else ValueError. Its header is written once per file, again only
+                when reconfigured for another size or rate. "length" precedes each with 24 little
+                endian bytes: u64 payload size, i64 pts (-1 if none), u32 width and u32 height (0
+                if not given), for variable resolutions and frame rates. Positional writes are never
+                framed, uses a thread over io_uring
+            fps: Frame rate of the Y4M stream header, a number or a fraction like "30000/1001"
+                (default 60)
+        """
+        return self._native.configure(
+            fileno,
+            ring=ring,
+            chunk=chunk,
+            iovecs=iovecs,
+            pipesize=pipesize,
+            splice=splice,
+            depth=depth,
+            memory=memory,
+            staging=staging,
+            copiers=copiers,
+            compress=compress,
+            level=level,
+            compressors=compressors,
+            nodelay=nodelay,
+            sndbuf=sndbuf,
+            zerocopy=zerocopy,
+            uring=uring,
+            cpus=(None if (cpus is None) else list(cpus)),
+            priority=priority,
+            hugepages=hugepages,
+            policy=policy,
+            writers=writers,
+            direct=direct,
+            framing=framing,
+            fps=(None if (fps is None) else _rate(fps)),
+        )
+
+    def stats(self) -> Dict[int, dict]:
+        """
+        Counters of every file descriptor piped to since it was configured or first seen, reset by
+        `configure()` and `close()`. Each is a dictionary of:
+
+        - bytes: Written to the fd, after any conversion and compression
+        - frames: Written successfully, as `sync()` would see them
+        - depth: Frames currently queued or being written
+        - queued: Bytes currently queued or being written
+        - blocked: Seconds `pipe()` waited for room in the queue, a staging block or the same buffer
+        - writes: Write syscalls, or io_uring completions
+        - partial: Writes the destination only took part of, a sign of a slow reader
+        - dropped: Frames discarded by the queue policy, never written
+        - latency: Frames by time from `pipe()` to written, index i counts those under 2**i us
+
+        All but depth and queued stay zero when built without statistics (`-Dstats=false`)
+        """
+        return self._native.stats()
+
+    def close(self) -> None:
+        """Syncs and deletes objects, of this instance only"""
+        self._native.close()
+
+
+def _rate(fps: Union[int, float, str, Fraction]) -> tuple:
+    rate = Fraction(fps).limit_denominator(1001)
+    return (rate.numerator, rate.denominator)
+
+
+# The module functions are the default instance's
+_default = Pipe(_turbopipe)
+pipe = _default.pipe
+pipe_to_path = _default.pipe_to_path
+sync = _default.sync
+pipe_async = _default.pipe_async
+sync_async = _default.sync_async
+configure = _default.configure
+stats = _default.stats
+close = _default.close
+
+
+class FramebufferPipe:
+    """
+    Pipes every frame rendered to a framebuffer through a ring of buffers owned by it. Each
+    `write()` starts an asynchronous readback into the GPU side buffer, and pipes the one read
+    `depth - 1` frames before, whose transfer is long done: mapping it doesn't stall. Only a
+    buffer still queued blocks, when the file descriptor falls behind
+
+    Args:
+        fbo: Framebuffer to read, of a fixed size
+        fileno: File descriptor or many of them to pipe to
+        depth: Buffers in the ring, frames in flight between the GPU and the fd (default 3)
+        components: Components read per pixel, 3 for rgb24 or 4 for rgba (default 3)
+        alignment: Row alignment of the reads, 1 for tightly packed rows (default 1)
+        dtype: Component type of the reads, as moderngl's (default "f1", bytes)
+        attachment: Color attachment to read (default 0)
+        turbopipe: Pipe instance writing the frames, the module's default if None
+        options: Passed to every `pipe()`, width and height default to the framebuffer's
+
+    Usage:
+        ```python
+        with turbopipe.FramebufferPipe(fbo, ffmpeg.stdin.fileno(), flip=True) as output:
+            for frame in range(frames):
+                render()
+                output.write()
         ```
     """
-    if isinstance(buffer, Buffer):
-        buffer = memoryview(buffer.mglo)
-    _turbopipe.pipe(buffer, fileno)
-    del buffer
 
+    def __init__(self,
+        fbo: Framebuffer,
+        fileno: Union[int, Iterable[int]],
+        depth: int=3,
+        components: int=3,
+        alignment: int=1,
+        dtype: str="f1",
+        attachment: int=0,
+        turbopipe: Optional[Pipe]=None,
+        **options,
+    ):
+        if (depth < 1):
+            raise ValueError(f"Depth must be at least 1, got {depth}")
+        self.fbo = fbo
+        self.fileno = (fileno if isinstance(fileno, int) else tuple(fileno))
+        self.components = components
+        self.alignment = alignment
+        self.dtype = dtype
+        self.attachment = attachment
+        self.turbopipe = (turbopipe or _default)
+        self.options = options
+        self.options.setdefault("width", fbo.width)
+        self.options.setdefault("height", fbo.height)
+
+        # Rows are padded to the alignment
+        row = (fbo.width * components * int(dtype[1:]))
+        row = ((row + alignment - 1) // alignment) * alignment
+        self._buffers: List[Buffer] = [fbo.ctx.buffer(reserve=(row * fbo.height)) for _ in range(depth)]
+        self._reading: Deque[Buffer] = deque()
+        self._next = 0
+
+    @property
+    def pending(self) -> int:
+        """Frames read from the framebuffer but not yet piped"""
+        return len(self._reading)
+
+    def write(self) -> None:
+        """Read the framebuffer's current content, piped once `depth - 1` newer frames are read"""
+        buffer = self._buffers[self._next]
+        self._next = ((self._next + 1) % len(self._buffers))
+
+        # Backpressure, the oldest buffer might still be queued
+        self.turbopipe.sync(buffer)
+        self.fbo.read_into(buffer,
+            components=self.components,
+            alignment=self.alignment,
+            attachment=self.attachment,
+            dtype=self.dtype,
+        )
+        self._reading.append(buffer)
+        while (len(self._reading) >= len(self._buffers)):
+            self.turbopipe.pipe(self._reading.popleft(), self.fileno, **self.options)
+
+    def flush(self) -> None:
+        """Pipe all frames read so far, they're written in order with the others"""
+        while self._reading:
+            self.turbopipe.pipe(self._reading.popleft(), self.fileno, **self.options)
 
-def sync(buffer: Optional[Union[Buffer, memoryview]]=None) -> None:
-    """Waits for any pending write operation on a buffer, or 'all buffers' if None, to finish"""
-    if isinstance(buffer, Buffer):
-        buffer = memoryview(buffer.mglo)
-    _turbopipe.sync(buffer)
-    del buffer
+    def close(self) -> None:
+        """Pipe and wait for all frames, then release the buffers"""
+        self.flush()
+        try:
+            for buffer in self._buffers:
+                self.turbopipe.sync(buffer)
+        finally:
+            for buffer in self._buffers:
+                buffer.release()
+            self._buffers.clear()
 
+    def __enter__(self) -> "FramebufferPipe":
+        return self
 
-def close() -> None:
-    """Syncs and deletes objects"""
-    _turbopipe.close()
+    def __exit__(self, *args) -> None:
+        self.close()
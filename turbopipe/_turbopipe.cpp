@@ -6,219 +6,3674 @@
 //
 // ------------------------------------------------------------------------------------------------|
 
-#define PY_SSIZE_T_CLEAN
-#include <Python.h>
+// The benchmark builds the core alone, without bindings
+#ifndef TURBOPIPE_NO_PYTHON
+    #define PY_SSIZE_T_CLEAN
+    #include <Python.h>
+#endif
 
 // Standard library
 #include <functional>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
 #include <chrono>
+#include <string>
+#include <cstdio>
 
 // Threading
 #include <condition_variable>
+#include <atomic>
 #include <thread>
 #include <mutex>
 
+// Platform
+#ifdef _WIN32
+    #define WIN32_LEAN_AND_MEAN
+    #define NOMINMAX
+    #include <windows.h>
+    #include <sys/stat.h>
+    #include <malloc.h>
+    #include <fcntl.h>
+    #include <io.h>
+
+    // Same lists of buffers as writev's, written one by one
+    struct iovec {void* iov_base; size_t iov_len;};
+#else
+    #include <sys/socket.h>
+    #include <sys/ioctl.h>
+    #include <sys/stat.h>
+    #include <sys/uio.h>
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+    #include <poll.h>
+    #include <unistd.h>
+    #include <climits>
+    #include <fcntl.h>
+#endif
+#ifdef __linux__
+    #include <sys/eventfd.h>
+    #include <sys/resource.h>
+    #include <sys/syscall.h>
+    #include <sys/mman.h>
+    #include <pthread.h>
+    #include <sched.h>
+#endif
+#if defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+    #define TURBOPIPE_ZEROCOPY
+    #include <linux/errqueue.h>
+#endif
+#if defined(__linux__) && defined(__has_include)
+    #if __has_include(<linux/io_uring.h>)
+        #ifdef __NR_io_uring_setup
+            #define TURBOPIPE_URING
+            #include <linux/io_uring.h>
+        #endif
+    #endif
+#endif
+
 // Data structure
 #include <unordered_set>
 #include <unordered_map>
+#include <vector>
+#include <map>
 #include <deque>
+#include <memory>
+
+// Instruction sets
+#if defined(__x86_64__) || defined(_M_X64)
+    #define TURBOPIPE_X86
+    #include <immintrin.h>
+    #ifdef _MSC_VER
+        #include <intrin.h>
+        #define TURBOPIPE_TARGET(isa)
+    #else
+        #define TURBOPIPE_TARGET(isa) __attribute__((target(isa)))
+    #endif
+#endif
+
+// Optional codecs, defined by the build when found
+#ifdef TURBOPIPE_LZ4
+    #include <lz4.h>
+#endif
+#ifdef TURBOPIPE_ZSTD
+    #include <zstd.h>
+#endif
+
+// Statistics are cheap relaxed counters, the build might still turn them off
+#ifdef TURBOPIPE_NO_STATS
+    #define TURBOPIPE_STATS false
+#else
+    #define TURBOPIPE_STATS true
+#endif
+
+using namespace std;
+
+// ------------------------------------------------------------------------------------------------|
+// Fast copies
+
+// Streaming stores bypass the caches, a large frame would only evict what the encoder needs
+using Copy = void (*)(char* dst, const char* src, size_t size);
+
+#ifdef TURBOPIPE_X86
+
+TURBOPIPE_TARGET("avx512f")
+static void stream_avx512(char* dst, const char* src, size_t size) {
+    size_t head = min(size, (size_t) ((64 - ((uintptr_t) dst & 63)) & 63));
+    memcpy(dst, src, head);
+    dst += head; src += head; size -= head;
+
+    for (; size >= 256; size -= 256, dst += 256, src += 256) {
+        __m512i a = _mm512_loadu_si512((const void*) (src +   0));
+        __m512i b = _mm512_loadu_si512((const void*) (src +  64));
+        __m512i c = _mm512_loadu_si512((const void*) (src + 128));
+        __m512i d = _mm512_loadu_si512((const void*) (src + 192));
+        _mm512_stream_si512((__m512i*) (dst +   0), a);
+        _mm512_stream_si512((__m512i*) (dst +  64), b);
+        _mm512_stream_si512((__m512i*) (dst + 128), c);
+        _mm512_stream_si512((__m512i*) (dst + 192), d);
+    }
+    _mm_sfence();
+    memcpy(dst, src, size);
+}
+
+TURBOPIPE_TARGET("avx2")
+static void stream_avx2(char* dst, const char* src, size_t size) {
+    size_t head = min(size, (size_t) ((32 - ((uintptr_t) dst & 31)) & 31));
+    memcpy(dst, src, head);
+    dst += head; src += head; size -= head;
+
+    for (; size >= 128; size -= 128, dst += 128, src += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i*) (src +  0));
+        __m256i b = _mm256_loadu_si256((const __m256i*) (src + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i*) (src + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i*) (src + 96));
+        _mm256_stream_si256((__m256i*) (dst +  0), a);
+        _mm256_stream_si256((__m256i*) (dst + 32), b);
+        _mm256_stream_si256((__m256i*) (dst + 64), c);
+        _mm256_stream_si256((__m256i*) (dst + 96), d);
+    }
+    _mm_sfence();
+    memcpy(dst, src, size);
+}
+
+static void stream_sse2(char* dst, const char* src, size_t size) {
+    size_t head = min(size, (size_t) ((16 - ((uintptr_t) dst & 15)) & 15));
+    memcpy(dst, src, head);
+    dst += head; src += head; size -= head;
+
+    for (; size >= 64; size -= 64, dst += 64, src += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i*) (src +  0));
+        __m128i b = _mm_loadu_si128((const __m128i*) (src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*) (src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i*) (src + 48));
+        _mm_stream_si128((__m128i*) (dst +  0), a);
+        _mm_stream_si128((__m128i*) (dst + 16), b);
+        _mm_stream_si128((__m128i*) (dst + 32), c);
+        _mm_stream_si128((__m128i*) (dst + 48), d);
+    }
+    _mm_sfence();
+    memcpy(dst, src, size);
+}
+
+#else
+
+static void stream_memcpy(char* dst, const char* src, size_t size) {
+    memcpy(dst, src, size);
+}
+
+#endif
+
+// Best copy kernel of the running CPU
+static Copy streamer() {
+    #ifdef TURBOPIPE_X86
+        #ifdef _MSC_VER
+            int info[4];
+            __cpuid(info, 1);
+            bool avx = (info[2] & (1 << 27)) != 0;
+            unsigned long long xcr = (avx ? _xgetbv(0) : 0);
+            __cpuidex(info, 7, 0);
+            bool avx2   = ((xcr & 0x06) == 0x06) && (info[1] & (1 <<  5));
+            bool avx512 = ((xcr & 0xE6) == 0xE6) && (info[1] & (1 << 16));
+        #else
+            __builtin_cpu_init();
+            bool avx2   = __builtin_cpu_supports("avx2");
+            bool avx512 = __builtin_cpu_supports("avx512f");
+        #endif
+        if (avx512)
+            return stream_avx512;
+        if (avx2)
+            return stream_avx2;
+        return stream_sse2;
+    #else
+        // Note: NEON has no streaming stores, libc's memcpy already does well
+        return stream_memcpy;
+    #endif
+}
+
+// Small pool of threads sharing the copy of large frames
+class Helpers {
+public:
+    static constexpr size_t STREAMING = (4 << 20); // Bytes above which not to pollute caches
+    static constexpr size_t SLICE     = (4 << 20); // Minimum bytes per thread
+    static constexpr size_t MAXIMUM   = 4;         // Threads on a single copy
+
+    ~Helpers() {
+        {
+            lock_guard<mutex> lock(this->lock);
+            running = false;
+        }
+        signal.notify_all();
+        for (thread& helper: threads)
+            helper.join();
+    }
+
+    // Copy some memory split in slices, or automatic with zero
+    void copy(void* dst, const void* src, size_t size, size_t slices=0) {
+        static const Copy stream = streamer();
+
+        if (size < STREAMING) {
+            memcpy(dst, src, size);
+            return;
+        }
+
+        slices = max((size_t) 1, min(automatic(slices), size / SLICE));
+
+        // Slice on cache lines, only the last one has a tail
+        size_t step = (((size / slices) + 63) / 64) * 64;
+        parallel(slices, [=](size_t index) {
+            size_t start = (index * step);
+            if (start < size)
+                stream((char*) dst + start, (const char*) src + start, min(step, size - start));
+        });
+    }
+
+    // Run task(i) for i in [0, count), the caller takes the first
+    void parallel(size_t count, function<void(size_t)> task) {
+        if (count <= 1) {
+            task(0);
+            return;
+        }
+
+        mutex finish;
+        condition_variable finished;
+        size_t pending = (count - 1);
+        {
+            lock_guard<mutex> lock(this->lock);
+            while (threads.size() < (count - 1))
+                threads.emplace_back(&Helpers::worker, this);
+            for (size_t index=1; index<count; index++) {
+                tasks.push_back([&, index] {
+                    task(index);
+                    lock_guard<mutex> lock(finish);
+                    if (--pending == 0)
+                        finished.notify_one();
+                });
+            }
+        }
+        signal.notify_all();
+
+        task(0);
+        unique_lock<mutex> wait(finish);
+        finished.wait(wait, [&pending] {return pending == 0;});
+    }
+
+    // Threads to split some work in, automatic with zero
+    static size_t automatic(size_t threads=0) {
+        if (threads == 0)
+            threads = min(MAXIMUM, max((size_t) 1, (size_t) thread::hardware_concurrency() / 4));
+        return threads;
+    }
+
+private:
+    deque<function<void()>> tasks;
+    condition_variable signal;
+    vector<thread> threads;
+    bool running = true;
+    mutex lock;
+
+    void worker() {
+        unique_lock<mutex> lock(this->lock);
+        while (true) {
+            signal.wait(lock, [this] {
+                return (!tasks.empty() || !running);
+            });
+            if (tasks.empty())
+                return;
+            function<void()> task = move(tasks.front());
+            tasks.pop_front();
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+    }
+};
+
+constexpr size_t Helpers::STREAMING;
+constexpr size_t Helpers::SLICE;
+constexpr size_t Helpers::MAXIMUM;
+
+// ------------------------------------------------------------------------------------------------|
+// Pixel formats
+
+// Layouts of raw frames that workers can convert between
+enum class Format: uint8_t {None, RGB, RGBA, YUV420P, NV12};
+
+static Format format(const char* name) {
+    if (strcmp(name, "rgb")     == 0) return Format::RGB;
+    if (strcmp(name, "rgba")    == 0) return Format::RGBA;
+    if (strcmp(name, "yuv420p") == 0) return Format::YUV420P;
+    if (strcmp(name, "nv12")    == 0) return Format::NV12;
+    return Format::None;
+}
+
+// Bytes of a converted frame, zero if the conversion isn't supported
+static size_t converted(Format from, Format into, size_t width, size_t height) {
+    size_t chroma = ((width + 1) / 2) * ((height + 1) / 2);
+    if (from != Format::RGB && from != Format::RGBA)
+        return 0;
+    if (into == Format::RGB && from == Format::RGBA)
+        return (width * height * 3);
+    if (into == Format::YUV420P || into == Format::NV12)
+        return (width * height + 2 * chroma);
+    return 0;
+}
+
+// Drop the alpha channel, each pixel's store overlaps the next one but the last
+static void rgba_rgb(const uint8_t* __restrict src, uint8_t* __restrict dst, size_t width) {
+    if (width == 0)
+        return;
+    for (size_t x=0; x<(width - 1); x++)
+        memcpy(dst + 3*x, src + 4*x, 4);
+    memcpy(dst + 3*(width - 1), src + 4*(width - 1), 3);
+}
+
+// Pad a row with an unused alpha, so both layouts share the same kernels
+static void rgb_rgba(const uint8_t* __restrict src, uint8_t* __restrict dst, size_t width) {
+    if (width == 0)
+        return;
+    for (size_t x=0; x<(width - 1); x++)
+        memcpy(dst + 4*x, src + 3*x, 4);
+    memcpy(dst + 4*(width - 1), src + 3*(width - 1), 3);
+}
+
+// BT.601 limited range in 8 bit fixed point, as FFmpeg's default for yuv420p
+static inline uint8_t luma(int r, int g, int b) {return (uint8_t) (((  66*r + 129*g +  25*b + 128) >> 8) +  16);}
+static inline uint8_t cb(int r, int g, int b)   {return (uint8_t) ((( -38*r -  74*g + 112*b + 128) >> 8) + 128);}
+static inline uint8_t cr(int r, int g, int b)   {return (uint8_t) (((112*r -  94*g -  18*b + 128) >> 8) + 128);}
+
+#ifdef TURBOPIPE_X86
+
+// Sum adjacent pairs of two vectors, SSE2 has no horizontal add
+static inline __m128i pairs(__m128i a, __m128i b) {
+    __m128 x = _mm_castsi128_ps(a), y = _mm_castsi128_ps(b);
+    return _mm_add_epi32(
+        _mm_castps_si128(_mm_shuffle_ps(x, y, _MM_SHUFFLE(2, 0, 2, 0))),
+        _mm_castps_si128(_mm_shuffle_ps(x, y, _MM_SHUFFLE(3, 1, 3, 1)))
+    );
+}
+
+// Weights of two 16 bit RGBA pixels into four partial sums, then into 32 bit results
+static inline __m128i weigh(__m128i lo, __m128i hi, __m128i weights, int offset) {
+    __m128i sum = pairs(_mm_madd_epi16(lo, weights), _mm_madd_epi16(hi, weights));
+    sum = _mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(128)), 8);
+    return _mm_add_epi32(sum, _mm_set1_epi32(offset));
+}
+
+// Average horizontal pairs of 16 bit RGBA pixels from two vectors of two pixels each
+static inline __m128i average(__m128i a, __m128i b) {
+    a = _mm_add_epi16(a, _mm_srli_si128(a, 8));
+    b = _mm_add_epi16(b, _mm_srli_si128(b, 8));
+    __m128i sum = _mm_unpacklo_epi64(a, b);
+    return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+}
+
+#endif
+
+// One row of luma from RGBA pixels
+static void luma_row(const uint8_t* in, uint8_t* out, size_t width) {
+    size_t x = 0;
+#ifdef TURBOPIPE_X86
+    const __m128i zero    = _mm_setzero_si128();
+    const __m128i weights = _mm_setr_epi16(66, 129, 25, 0, 66, 129, 25, 0);
+    for (; x + 8 <= width; x += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i*) (in + 4*x +  0));
+        __m128i b = _mm_loadu_si128((const __m128i*) (in + 4*x + 16));
+        __m128i y0 = weigh(_mm_unpacklo_epi8(a, zero), _mm_unpackhi_epi8(a, zero), weights, 16);
+        __m128i y1 = weigh(_mm_unpacklo_epi8(b, zero), _mm_unpackhi_epi8(b, zero), weights, 16);
+        __m128i y  = _mm_packus_epi16(_mm_packs_epi32(y0, y1), zero);
+        _mm_storel_epi64((__m128i*) (out + x), y);
+    }
+#endif
+    for (; x<width; x++)
+        out[x] = luma(in[4*x + 0], in[4*x + 1], in[4*x + 2]);
+}
+
+// One row of chroma averaging 2x2 blocks of RGBA pixels, repeating the last column on odd widths
+static void chroma_row(const uint8_t* top, const uint8_t* bot, uint8_t* u, uint8_t* v, size_t width, bool nv12) {
+    size_t cwidth = ((width + 1) / 2);
+    size_t x = 0;
+#ifdef TURBOPIPE_X86
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i wu = _mm_setr_epi16(-38, -74, 112, 0, -38, -74, 112, 0);
+    const __m128i wv = _mm_setr_epi16(112, -94, -18, 0, 112, -94, -18, 0);
+    for (; 2*x + 8 <= width; x += 4) {
+        __m128i t0 = _mm_loadu_si128((const __m128i*) (top + 8*x +  0));
+        __m128i t1 = _mm_loadu_si128((const __m128i*) (top + 8*x + 16));
+        __m128i b0 = _mm_loadu_si128((const __m128i*) (bot + 8*x +  0));
+        __m128i b1 = _mm_loadu_si128((const __m128i*) (bot + 8*x + 16));
+
+        // Vertical sums of pixels 0-1, 2-3, 4-5, 6-7 then horizontal averages
+        __m128i c0 = average(
+            _mm_add_epi16(_mm_unpacklo_epi8(t0, zero), _mm_unpacklo_epi8(b0, zero)),
+            _mm_add_epi16(_mm_unpackhi_epi8(t0, zero), _mm_unpackhi_epi8(b0, zero)));
+        __m128i c1 = average(
+            _mm_add_epi16(_mm_unpacklo_epi8(t1, zero), _mm_unpacklo_epi8(b1, zero)),
+            _mm_add_epi16(_mm_unpackhi_epi8(t1, zero), _mm_unpackhi_epi8(b1, zero)));
+
+        __m128i cu = _mm_packus_epi16(_mm_packs_epi32(weigh(c0, c1, wu, 128), zero), zero);
+        __m128i cv = _mm_packus_epi16(_mm_packs_epi32(weigh(c0, c1, wv, 128), zero), zero);
+        if (nv12) {
+            _mm_storel_epi64((__m128i*) (u + 2*x), _mm_unpacklo_epi8(cu, cv));
+        } else {
+            int su = _mm_cvtsi128_si32(cu), sv = _mm_cvtsi128_si32(cv);
+            memcpy(u + x, &su, 4);
+            memcpy(v + x, &sv, 4);
+        }
+    }
+#endif
+    for (; x<cwidth; x++) {
+        size_t a = (2*x) * 4;
+        size_t b = min(2*x + 1, width - 1) * 4;
+        int r = (top[a + 0] + top[b + 0] + bot[a + 0] + bot[b + 0] + 2) >> 2;
+        int g = (top[a + 1] + top[b + 1] + bot[a + 1] + bot[b + 1] + 2) >> 2;
+        int l = (top[a + 2] + top[b + 2] + bot[a + 2] + bot[b + 2] + 2) >> 2;
+        if (nv12) {
+            u[2*x + 0] = cb(r, g, l);
+            u[2*x + 1] = cr(r, g, l);
+        } else {
+            u[x] = cb(r, g, l);
+            v[x] = cr(r, g, l);
+        }
+    }
+}
+
+// Pairs of rows at a time while they're still in cache, repeating the last one on odd heights
+template <int C>
+static void rgb_yuv420(const uint8_t* src, uint8_t* dst, size_t width, size_t height, bool nv12, bool flip) {
+    size_t cwidth  = ((width  + 1) / 2);
+    size_t cheight = ((height + 1) / 2);
+    uint8_t* planes = (dst + width * height);
+    uint8_t* last = (planes + cwidth * cheight);
+    vector<uint8_t> padded((C == 3) ? (2 * width * 4) : 0);
+
+    for (size_t y=0; y<cheight; y++) {
+        size_t t = (2*y), b = min(2*y + 1, height - 1);
+        const uint8_t* top = (src + (flip ? (height - 1 - t) : t) * width * C);
+        const uint8_t* bot = (src + (flip ? (height - 1 - b) : b) * width * C);
+        if (C == 3) {
+            rgb_rgba(top, padded.data(), width);
+            rgb_rgba(bot, padded.data() + width * 4, width);
+            top = padded.data();
+            bot = padded.data() + width * 4;
+        }
+        luma_row(top, dst + t * width, width);
+        if (b != t)
+            luma_row(bot, dst + b * width, width);
+        if (nv12)
+            chroma_row(top, bot, planes + 2 * y * cwidth, nullptr, width, true);
+        else
+            chroma_row(top, bot, planes + y * cwidth, last + y * cwidth, width, false);
+    }
+}
+
+// Convert a frame into some memory of at least converted() bytes, optionally reading rows bottom-up
+static void convert(Format from, Format into, const void* src, void* dst, size_t width, size_t height, bool flip=false) {
+    const uint8_t* in = (const uint8_t*) src;
+    uint8_t* out = (uint8_t*) dst;
+    bool nv12 = (into == Format::NV12);
+
+    if (into == Format::RGB) {
+        for (size_t y=0; y<height; y++)
+            rgba_rgb(in + (flip ? (height - 1 - y) : y) * width * 4, out + y * width * 3, width);
+    } else if (from == Format::RGBA) {
+        rgb_yuv420<4>(in, out, width, height, nv12, flip);
+    } else {
+        rgb_yuv420<3>(in, out, width, height, nv12, flip);
+    }
+}
+
+// ------------------------------------------------------------------------------------------------|
+// Compression
+
+enum class Codec: uint8_t {None, LZ4, ZSTD};
+
+// Parse a codec name, false if unknown or not in this build
+static bool codec(const char* name, Codec& codec) {
+    if (strcmp(name, "none") == 0) {
+        codec = Codec::None;
+        return true;
+    }
+    #ifdef TURBOPIPE_LZ4
+        if (strcmp(name, "lz4") == 0) {
+            codec = Codec::LZ4;
+            return true;
+        }
+    #endif
+    #ifdef TURBOPIPE_ZSTD
+        if (strcmp(name, "zstd") == 0) {
+            codec = Codec::ZSTD;
+            return true;
+        }
+    #endif
+    return false;
+}
+
+static const char* codec(Codec codec) {
+    switch (codec) {
+        case Codec::LZ4:  return "lz4";
+        case Codec::ZSTD: return "zstd";
+        default:          return "none";
+    }
+}
+
+// Frames split in blocks compressed in parallel, each with a little endian header of its
+// size and packed size, stored as is if it didn't shrink. An empty block ends the frame
+class Packer {
+public:
+    static constexpr size_t BLOCK  = (1 << 20); // Bytes of a frame per block
+    static constexpr size_t HEADER = 8;         // Bytes of a block's header
+
+    // Compress a frame into memory owned until the next call, returns its size
+    size_t pack(Codec codec, int level, const char* data, size_t size, size_t threads, const char** packed) {
+        size_t blocks = ((size + BLOCK - 1) / BLOCK);
+        size_t stride = (HEADER + bound(codec, BLOCK));
+        memory.resize(blocks * stride + HEADER);
+        vector<size_t>& lengths = this->lengths;
+        lengths.assign(blocks, 0);
+
+        // Each thread takes a contiguous run of blocks
+        threads = max((size_t) 1, min(Helpers::automatic(threads), blocks));
+        size_t run = ((blocks + threads - 1) / threads);
+        helpers.parallel(threads, [&, codec, level](size_t index) {
+            for (size_t block=(index * run); block<min(blocks, (index + 1) * run); block++) {
+                const char* src = (data + block * BLOCK);
+                size_t length = min(BLOCK, size - block * BLOCK);
+                char* dst = (memory.data() + block * stride);
+                size_t written = compress(codec, level, src, length, dst + HEADER, stride - HEADER);
+                if (written == 0 || written >= length) {
+                    memcpy(dst + HEADER, src, length);
+                    written = length;
+                }
+                store(dst + 0, length);
+                store(dst + 4, written);
+                lengths[block] = (HEADER + written);
+            }
+        });
+
+        // Pack the blocks back to back and close the frame
+        size_t total = 0;
+        for (size_t block=0; block<blocks; block++) {
+            memmove(memory.data() + total, memory.data() + block * stride, lengths[block]);
+            total += lengths[block];
+        }
+        memset(memory.data() + total, 0, HEADER);
+        *packed = memory.data();
+        return (total + HEADER);
+    }
+
+private:
+    vector<char> memory;
+    vector<size_t> lengths;
+    Helpers helpers;
+
+    static void store(char* dst, size_t value) {
+        for (int byte=0; byte<4; byte++)
+            dst[byte] = (char) ((value >> (8 * byte)) & 0xFF);
+    }
+
+    // Worst case bytes of a compressed block
+    static size_t bound(Codec codec, size_t size) {
+        #ifdef TURBOPIPE_LZ4
+            if (codec == Codec::LZ4)
+                return LZ4_compressBound((int) size);
+        #endif
+        #ifdef TURBOPIPE_ZSTD
+            if (codec == Codec::ZSTD)
+                return ZSTD_compressBound(size);
+        #endif
+        (void) codec;
+        return size;
+    }
+
+    // Compress a block at some level, the codec's fastest by default. Zero on failure
+    static size_t compress(Codec codec, int level, const char* src, size_t size, char* dst, size_t capacity) {
+        #ifdef TURBOPIPE_LZ4
+            if (codec == Codec::LZ4) {
+                int written = LZ4_compress_fast(src, dst, (int) size, (int) capacity, max(level, 1));
+                return (written > 0 ? (size_t) written : 0);
+            }
+        #endif
+        #ifdef TURBOPIPE_ZSTD
+            if (codec == Codec::ZSTD) {
+                // Contexts are expensive to create, each thread keeps one
+                static thread_local unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx*)> context(
+                    ZSTD_createCCtx(), ZSTD_freeCCtx);
+                size_t written = ZSTD_compressCCtx(context.get(), dst, capacity, src, size, (level ? level : 1));
+                return (ZSTD_isError(written) ? 0 : written);
+            }
+        #endif
+        (void) codec; (void) level; (void) src; (void) size; (void) dst; (void) capacity;
+        return 0;
+    }
+};
+
+constexpr size_t Packer::BLOCK;
+constexpr size_t Packer::HEADER;
+
+// ------------------------------------------------------------------------------------------------|
+// Framing
+
+enum class Framing: uint8_t {None, Y4M, Length};
+
+// Parse a framing name, false if unknown
+static bool framing(const char* name, Framing& framing) {
+    if (strcmp(name, "none") == 0)
+        framing = Framing::None;
+    else if (strcmp(name, "y4m") == 0)
+        framing = Framing::Y4M;
+    else if (strcmp(name, "length") == 0)
+        framing = Framing::Length;
+    else
+        return false;
+    return true;
+}
+
+static const char* framing(Framing framing) {
+    switch (framing) {
+        case Framing::Y4M:    return "y4m";
+        case Framing::Length: return "length";
+        default:              return "none";
+    }
+}
+
+// Headers written along each frame so readers find its boundaries and size: a YUV4MPEG2
+// stream of yuv420p frames, or per frame little endian payload bytes, timestamp, width
+// and height. Memory of the headers is owned until the next batch
+class Framer {
+public:
+    static constexpr size_t LENGTH = 24; // Bytes of a length framed header
+
+    // Headers of a new batch of some frames, the previous ones are no longer referenced
+    void reset(size_t frames) {
+        memory.resize(frames * LENGTH);
+        used = 0;
+    }
+
+    // Whether a frame needs a stream header first, only Y4M's first one or a new size
+    bool fresh(Framing framing, size_t width, size_t height) {
+        if (framing != Framing::Y4M || (width == shown[0] && height == shown[1]))
+            return false;
+        shown[0] = width;
+        shown[1] = height;
+        return true;
+    }
+
+    // The Y4M stream header of frames of some size
+    iovec stream(size_t width, size_t height, const uint32_t rate[2]) {
+        char text[128];
+        int length = snprintf(text, sizeof(text), "YUV4MPEG2 W%zu H%zu F%u:%u Ip A1:1 C420jpeg\n",
+            width, height, rate[0], max(rate[1], (uint32_t) 1));
+        header.assign(text, (size_t) length);
+        return {(void*) header.data(), header.size()};
+    }
+
+    // Precedes a frame of some payload bytes
+    iovec frame(Framing framing, size_t bytes, int64_t pts, size_t width, size_t height) {
+        static const char y4m[] = "FRAME\n";
+        if (framing == Framing::Y4M)
+            return {(void*) y4m, sizeof(y4m) - 1};
+
+        char* dst = (memory.data() + used);
+        store(dst + 0,  (uint64_t) bytes, 8);
+        store(dst + 8,  (uint64_t) pts, 8);
+        store(dst + 16, (uint64_t) width, 4);
+        store(dst + 20, (uint64_t) height, 4);
+        used += LENGTH;
+        return {(void*) dst, LENGTH};
+    }
+
+private:
+    vector<char> memory;
+    size_t used = 0;
+    string header;
+    size_t shown[2] = {0, 0};
+
+    static void store(char* dst, uint64_t value, int bytes) {
+        for (int byte=0; byte<bytes; byte++)
+            dst[byte] = (char) ((value >> (8 * byte)) & 0xFF);
+    }
+};
+
+constexpr size_t Framer::LENGTH;
+
+// ------------------------------------------------------------------------------------------------|
+// TurboPipe internals
+
+// What pipe() does with queued frames the worker didn't start yet when there's no room
+enum class Policy: uint8_t {FIFO, DropOldest, LatestOnly};
+
+// Parse a queue policy name, false if unknown
+static bool policy(const char* name, Policy& policy) {
+    if (strcmp(name, "fifo") == 0)
+        policy = Policy::FIFO;
+    else if (strcmp(name, "drop_oldest") == 0)
+        policy = Policy::DropOldest;
+    else if (strcmp(name, "latest_only") == 0)
+        policy = Policy::LatestOnly;
+    else
+        return false;
+    return true;
+}
+
+static const char* policy(Policy policy) {
+    switch (policy) {
+        case Policy::DropOldest: return "drop_oldest";
+        case Policy::LatestOnly: return "latest_only";
+        default:                 return "fifo";
+    }
+}
+
+struct Work {
+    void*  data = nullptr;
+    size_t size = 0;
+    int    file = -1;
+    shared_ptr<void> keep; // Released once written, eg. staging memory
+
+    // Optional conversion done by the worker
+    Format from = Format::None;
+    Format into = Format::None;
+    uint32_t width  = 0;
+    uint32_t height = 0;
+
+    // Write rows bottom-up, as OpenGL reads framebuffers
+    bool flip = false;
+
+    // Written this many times in a row, for held frames
+    size_t repeat = 1;
+
+    // Timestamp in length framed headers, negative if none
+    int64_t pts = -1;
+
+    // When it was queued, for latency statistics
+    chrono::steady_clock::time_point queued;
+
+    // Written at this offset by the writers of the file in parallel, negative for in order
+    int64_t offset = -1;
+
+    // Or into a new file at this path, from its start unless an offset is given
+    string path;
+
+    bool positional() const {return (offset >= 0 || !path.empty());}
+};
+
+// Counters of a channel since it started, only read for reporting
+struct Stats {
+    static constexpr size_t BUCKETS = 32;
+
+    atomic<uint64_t> bytes{0};    // Taken by the kernel, after conversions and compression
+    atomic<uint64_t> frames{0};   // Completed
+    atomic<uint64_t> blocked{0};  // Nanoseconds pipe() waited for room or the same memory
+    atomic<uint64_t> writes{0};   // Write syscalls
+    atomic<uint64_t> partial{0};  // Writes the kernel only took part of
+    atomic<uint64_t> dropped{0};  // Frames discarded by the queue policy, never written
+
+    // Queued to completed latencies, each under 2**index microseconds
+    atomic<uint64_t> latency[BUCKETS] = {};
+
+    static void add(atomic<uint64_t>& counter, uint64_t value) {
+        if (TURBOPIPE_STATS)
+            counter.fetch_add(value, memory_order_relaxed);
+    }
+
+    // Time since some point in nanoseconds
+    static uint64_t since(chrono::steady_clock::time_point start) {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    }
+
+    void write(size_t requested, size_t written) {
+        add(writes, 1);
+        add(bytes, written);
+        if (written < requested)
+            add(partial, 1);
+    }
+
+    void complete(const Work& work) {
+        if (!TURBOPIPE_STATS)
+            return;
+        uint64_t micros = (since(work.queued) / 1000);
+        size_t bucket = 0;
+        while (micros > 0 && bucket < (BUCKETS - 1)) {
+            micros >>= 1;
+            bucket++;
+        }
+        add(latency[bucket], 1);
+        add(frames, 1);
+    }
+};
+
+constexpr size_t Stats::BUCKETS;
+
+struct Options {
+    size_t ring   = 0;       // Lock-free ring capacity, zero for the locked deque
+    size_t chunk  = 0;       // Maximum bytes per write syscall, zero adapts
+    size_t iovecs = 16;      // Maximum frames per vectored write
+    long pipesize = 0;       // Pipe capacity cap, zero for the system's maximum, negative keeps
+    bool splice   = false;   // Map pages into pipes with vmsplice, no copies (Linux)
+    size_t depth  = 0;       // Maximum frames queued, zero for unlimited
+    size_t memory = 0;       // Maximum bytes queued, zero for unlimited
+    size_t staging = 4;      // Staging blocks for copied frames
+    size_t copiers = 0;      // Threads sharing the copy of a large frame, zero automatic
+    Codec compress = Codec::None; // Framed compression of every frame
+    int level = 0;           // Compression level, zero for the codec's fastest
+    size_t compressors = 0;  // Threads compressing a frame's blocks, zero automatic
+    bool nodelay  = true;    // Disable Nagle's algorithm on TCP sockets
+    long sndbuf   = 0;       // Socket send buffer bytes, zero keeps the kernel's autotuning
+    bool zerocopy = false;   // Send pages of sockets with MSG_ZEROCOPY, no copies (Linux)
+    bool uring    = false;   // Written by the shared io_uring engine, not a thread (Linux)
+    vector<int> cpus;        // CPUs the worker runs on and staging is local to, empty for any
+    int priority  = 0;       // Nice value of the worker, zero keeps the process' one
+    bool hugepages = false;  // Staging blocks on huge pages (Linux)
+    Policy policy = Policy::FIFO; // Discard not yet started frames instead of blocking
+    size_t writers = 4;      // Threads of positional writes, in parallel on the same file
+    bool direct   = false;   // Positional writes skip the page cache with O_DIRECT when aligned (Linux)
+    Framing framing = Framing::None; // Headers written along every frame in order
+    uint32_t rate[2] = {60, 1}; // Frame rate of the Y4M stream header, as a fraction
+};
+
+#ifdef __linux__
+
+// Grow the kernel buffer of a pipe for fewer context switches with its reader,
+// as far as the cap and user limits allow. Returns the capacity, zero if not a pipe
+static size_t pipesize(int file, long cap) {
+    struct stat info;
+    if (fstat(file, &info) != 0 || !S_ISFIFO(info.st_mode))
+        return 0;
+
+    long current = fcntl(file, F_GETPIPE_SZ);
+    if (current < 0)
+        return 0;
+    if (cap < 0)
+        return current;
+
+    // Unprivileged processes can grow up to this size
+    if (cap == 0) {
+        FILE* proc = fopen("/proc/sys/fs/pipe-max-size", "r");
+        if (proc != nullptr) {
+            if (fscanf(proc, "%ld", &cap) != 1)
+                cap = 0;
+            fclose(proc);
+        }
+    }
+
+    // Might be over the per-user soft limit of pipe pages, try smaller
+    for (long size=cap; size > current; size /= 2) {
+        if (fcntl(file, F_SETPIPE_SZ, size) >= 0)
+            break;
+    }
+
+    return fcntl(file, F_GETPIPE_SZ);
+}
+
+#endif
+
+#ifdef _WIN32
+
+// Anonymous pipes are named pipes fixed in size by their creator, only report it
+static size_t pipesize(int file) {
+    HANDLE handle = (HANDLE) _get_osfhandle(file);
+    DWORD size = 0;
+    if (handle == INVALID_HANDLE_VALUE || GetFileType(handle) != FILE_TYPE_PIPE)
+        return 0;
+    if (!GetNamedPipeInfo(handle, nullptr, &size, nullptr, nullptr))
+        return 0;
+    return size;
+}
+
+// Closest errno of a failed Windows call, as the CRT would
+static int errnum(DWORD error) {
+    switch (error) {
+        case ERROR_BROKEN_PIPE:
+        case ERROR_NO_DATA:
+        case ERROR_PIPE_NOT_CONNECTED: return EPIPE;
+        case ERROR_INVALID_HANDLE:     return EBADF;
+        case ERROR_ACCESS_DENIED:      return EACCES;
+        case ERROR_DISK_FULL:
+        case ERROR_HANDLE_DISK_FULL:   return ENOSPC;
+        case ERROR_NOT_ENOUGH_MEMORY:
+        case ERROR_OUTOFMEMORY:        return ENOMEM;
+        case ERROR_OPERATION_ABORTED:  return EINTR;
+        default:                       return EIO;
+    }
+}
+
+#endif
+
+#ifndef _WIN32
+
+// Tune a socket for streaming frames, with the options in effect. False if not a socket
+static bool tune(int file, Options& options) {
+    struct stat info;
+    if (fstat(file, &info) != 0 || !S_ISSOCK(info.st_mode)) {
+        options.sndbuf = 0;
+        options.zerocopy = false;
+        return false;
+    }
+
+    // Frames are large, small segments waiting for acks only add latency. Fails if not TCP
+    int enable = 1;
+    if (options.nodelay)
+        setsockopt(file, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    if (options.sndbuf > 0) {
+        int size = (int) min(options.sndbuf, (long) INT_MAX);
+        setsockopt(file, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    }
+    #ifdef SO_NOSIGPIPE
+        setsockopt(file, SOL_SOCKET, SO_NOSIGPIPE, &enable, sizeof(enable));
+    #endif
+    #ifdef TURBOPIPE_ZEROCOPY
+        if (options.zerocopy)
+            options.zerocopy = (setsockopt(file, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) == 0);
+    #else
+        options.zerocopy = false;
+    #endif
+
+    int size = 0;
+    socklen_t length = sizeof(size);
+    if (getsockopt(file, SOL_SOCKET, SO_SNDBUF, &size, &length) == 0)
+        options.sndbuf = size;
+    return true;
+}
+
+#endif
+
+// Pin the calling thread to some CPUs and set its nice value, best effort: raising
+// the priority needs privileges. Windows maps nice values to its priority levels
+static void place(const vector<int>& cpus, int priority) {
+    #ifdef __linux__
+        if (!cpus.empty()) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (int cpu: cpus)
+                if (cpu >= 0 && cpu < CPU_SETSIZE)
+                    CPU_SET(cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        }
+        if (priority != 0)
+            setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), priority);
+    #elif defined(_WIN32)
+        if (!cpus.empty()) {
+            DWORD_PTR mask = 0;
+            for (int cpu: cpus)
+                if (cpu >= 0 && cpu < (int) (sizeof(mask) * 8))
+                    mask |= ((DWORD_PTR) 1 << cpu);
+            if (mask != 0)
+                SetThreadAffinityMask(GetCurrentThread(), mask);
+        }
+        if (priority != 0) {
+            int level = THREAD_PRIORITY_NORMAL;
+            if      (priority <= -15) level = THREAD_PRIORITY_HIGHEST;
+            else if (priority <=  -5) level = THREAD_PRIORITY_ABOVE_NORMAL;
+            else if (priority >=  15) level = THREAD_PRIORITY_LOWEST;
+            else if (priority >=   5) level = THREAD_PRIORITY_BELOW_NORMAL;
+            SetThreadPriority(GetCurrentThread(), level);
+        }
+    #else
+        // Note: macOS has neither thread affinity nor per-thread nice values
+        (void) cpus;
+        (void) priority;
+    #endif
+}
+
+// Bytes per write syscall, fixed or adapting to the destination: grows while writes
+// complete fully and shrinks when the kernel only takes part of them
+class Chunk {
+public:
+    static constexpr size_t MINIMUM = (4 << 10);
+    static constexpr size_t INITIAL = (64 << 10);
+    static constexpr size_t MAXIMUM = (16 << 20);
+
+    Chunk(size_t fixed):
+        size(fixed ? fixed : INITIAL),
+        adaptive(fixed == 0) {}
+
+    size_t size;
+
+    void update(size_t requested, size_t written) {
+        if (!adaptive)
+            return;
+        if (written >= requested && requested >= size)
+            size = min(size * 2, MAXIMUM);
+        else if (written < requested)
+            size = max(size / 2, MINIMUM);
+    }
+
+private:
+    bool adaptive;
+};
+
+constexpr size_t Chunk::MINIMUM;
+constexpr size_t Chunk::INITIAL;
+constexpr size_t Chunk::MAXIMUM;
+
+// Page aligned memory blocks for copies of frames, reused without allocating once
+// grown to the frame size. Acquiring waits for a free block when all are queued
+class Pool: public enable_shared_from_this<Pool> {
+public:
+    static constexpr size_t ALIGN = 4096;
+
+    static constexpr size_t HUGEPAGE = (2 << 20);
+
+    Pool(size_t count, bool hugepages=false, vector<int> cpus={}):
+        count(max(count, (size_t) 1)),
+        hugepages(hugepages),
+        cpus(cpus) {}
+
+    ~Pool() {
+        for (Block& block: blocks)
+            release(block);
+    }
+
+    // A block of at least some size, given back to the pool when the keep dies, null if out of memory
+    shared_ptr<void> acquire(size_t size, void** data) {
+        unique_lock<mutex> lock(this->lock);
+        available.wait(lock, [this] {
+            return (!blocks.empty() || created < count);
+        });
+
+        Block block = {nullptr, 0, false};
+        if (blocks.empty()) {
+            created++;
+        } else {
+            block = blocks.back();
+            blocks.pop_back();
+        }
+        lock.unlock();
+
+        // Frame sizes rarely change, grow the block when they do. New ones are at
+        // least a page, even for empty frames
+        if (block.data == nullptr || block.size < size) {
+            release(block);
+            block = allocate(max(size, (size_t) 1));
+        }
+
+        // Out of memory, the next acquire tries allocating again
+        *data = block.data;
+        if (block.data == nullptr) {
+            lock_guard<mutex> relock(this->lock);
+            created--;
+            available.notify_one();
+            return nullptr;
+        }
+        shared_ptr<Pool> pool = shared_from_this();
+        return shared_ptr<void>(block.data, [pool, block](void*) {
+            lock_guard<mutex> lock(pool->lock);
+            pool->blocks.push_back(block);
+            pool->available.notify_one();
+        });
+    }
+
+private:
+    struct Block {void* data; size_t size; bool mapped;};
+    vector<Block> blocks;
+    condition_variable available;
+    size_t created = 0;
+    size_t count;
+    bool hugepages;
+    vector<int> cpus;
+    mutex lock;
+
+    Block allocate(size_t size) {
+        size_t align = (hugepages ? HUGEPAGE : ALIGN);
+        size = ((size + align - 1) / align) * align;
+        Block block = {nullptr, size, false};
+
+        #ifdef _WIN32
+            block.data = _aligned_malloc(size, align);
+        #else
+            #ifdef MAP_HUGETLB
+                // Reserved huge pages first, then transparent ones
+                if (hugepages) {
+                    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                    if (data != MAP_FAILED)
+                        block = {data, size, true};
+                }
+            #endif
+            if (block.data == nullptr && posix_memalign(&block.data, align, size) != 0)
+                block.data = nullptr;
+            #ifdef MADV_HUGEPAGE
+                if (hugepages && !block.mapped && block.data != nullptr)
+                    madvise(block.data, size, MADV_HUGEPAGE);
+            #endif
+        #endif
+
+        // Pages are placed on the NUMA node of the thread first touching them
+        if (!cpus.empty() && block.data != nullptr) {
+            thread([this, &block] {
+                place(cpus, 0);
+                for (size_t offset=0; offset<block.size; offset+=ALIGN)
+                    ((volatile char*) block.data)[offset] = 0;
+            }).join();
+        }
+        return block;
+    }
+
+    static void release(const Block& block) {
+        if (block.data == nullptr)
+            return;
+        #ifdef _WIN32
+            _aligned_free(block.data);
+        #else
+            if (block.mapped)
+                munmap(block.data, block.size);
+            else
+                free(block.data);
+        #endif
+    }
+};
+
+constexpr size_t Pool::ALIGN;
+constexpr size_t Pool::HUGEPAGE;
+
+// Bounded single producer, single consumer lock-free queue. The tail only moves
+// once the consumer is done with an item, so everything in [tail, head) is in flight
+template <typename T>
+class Ring {
+public:
+    Ring(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        slots.resize(size);
+        mask = (size - 1);
+    }
+
+    size_t capacity() const {return mask + 1;}
+    T& at(size_t index) {return slots[index & mask];}
+
+    // Producer side, must not be full
+    void push(const T& item) {
+        size_t index = head.load(memory_order_relaxed);
+        slots[index & mask] = item;
+        head.store(index + 1);
+    }
+
+    // Consumer side, the oldest items are done
+    void release(size_t count) {
+        tail.store(tail.load(memory_order_relaxed) + count);
+    }
+
+    atomic<size_t> head{0};
+    atomic<size_t> tail{0};
+
+private:
+    vector<T> slots;
+    size_t mask;
+};
+
+// All the state of a single file descriptor, shared by its worker and producers
+struct Channel {
+    Channel(int file, Options options): options(options) {
+
+        // Headers are the worker's memory, never mapped into pipes or sent zero-copy.
+        // Y4M readers expect raw planes after each header
+        if (options.framing != Framing::None) {
+            this->options.splice = false;
+            this->options.zerocopy = false;
+        }
+        if (options.framing == Framing::Y4M)
+            this->options.compress = Codec::None;
+        #ifdef __linux__
+            this->options.pipesize = pipesize(file, options.pipesize);
+            this->options.splice = (this->options.splice && this->options.pipesize > 0);
+        #else
+            this->options.splice = false;
+            this->options.hugepages = false;
+            this->options.direct = false;
+        #endif
+        #ifndef _WIN32
+            socket = tune(file, this->options);
+        #else
+            this->options.pipesize = (file >= 0 ? pipesize(file) : 0);
+            this->options.sndbuf = 0;
+            this->options.zerocopy = false;
+        #endif
+        this->options.iovecs = max(options.iovecs, (size_t) 1);
+        this->options.staging = max(options.staging, (size_t) 1);
+        this->options.writers = max(options.writers, (size_t) 1);
+        pool = make_shared<Pool>(this->options.staging, this->options.hugepages, this->options.cpus);
+
+        // Only the locked queue can take back frames from the worker
+        if (options.policy != Policy::FIFO)
+            this->options.ring = 0;
+        if (this->options.ring) {
+            ring.reset(new Ring<Work>(options.ring));
+            this->options.ring = ring->capacity();
+        }
+    }
+
+    ~Channel() {stop();}
+
+    // Frames queued or being written, the locked queue also tracks positional ones
+    size_t depth() {
+        lock_guard<mutex> lock(this->lock);
+        return ((ring ? (ring->head.load() - ring->tail.load()) : 0) + queue.size());
+    }
+
+    Options options;
+    bool socket = false;          // Written with send, maybe with zero-copy
+    int doorbell = -1;            // Eventfd of the shared engine writing this one, if any
+    atomic<bool>* armed = nullptr; // The engine waits for completions, ring the doorbell
+    unordered_set<void*> queue;   // Memory pending or being written
+    unordered_set<void*> failures; // Memory done after a failed write, until synced on
+    deque<Work> stream;           // Work not yet picked by the worker
+    deque<Work> placed;           // Positional work not yet picked by a writer
+    condition_variable signal;    // Wakes the worker: new work or exit
+    condition_variable placing;   // Wakes the writers: new positional work or exit
+    condition_variable complete;  // Wakes producers: some work is done
+    thread worker;
+    vector<thread> writers;       // Started with the first positional work
+    mutex lock;
+    bool running = true;
+
+    // Copies of frames for pipes that return immediately
+    shared_ptr<Pool> pool;
+
+    // First errno of a failed write, later work is discarded
+    atomic<int> error{0};
+
+    // Retiring, producers must find the file's next channel
+    atomic<bool> sealed{false};
+
+    // Width and height of the Y4M stream header once claimed by a frame, zero before
+    atomic<uint64_t> framed{0};
+
+    // Total size of the work queued and being written
+    atomic<size_t> bytes{0};
+
+    // Counters for turbopipe.stats()
+    Stats stats;
+
+    // Interval to check on deferred completions while idle
+    static constexpr chrono::microseconds POLL{100};
+
+    // Lock-free path, the ring replaces both queue and stream
+    unique_ptr<Ring<Work>> ring;
+    atomic<bool> sleeping{false}; // The worker is parked on signal
+    atomic<int> waiting{0};       // Producers parked on complete
+    mutex producer;               // Keeps the ring single producer
+    size_t picked = 0;            // Worker only, next ring index to write
+
+    // Why the framing can't carry some work, null if it can. The first accepted Y4M frame
+    // claims the stream header's size, all later frames must match it
+    const char* refused(const Work& work) {
+        if (options.framing != Framing::Y4M || work.positional())
+            return nullptr;
+        if (work.width == 0 || work.height == 0)
+            return "Y4M frames need a width and height";
+        if (work.into != Format::YUV420P && work.into != Format::None)
+            return "Y4M frames are yuv420p, converted or given";
+        size_t chroma = ((work.width + 1) / 2) * ((work.height + 1) / 2);
+        if (work.into == Format::None && work.size != ((size_t) work.width * work.height + 2 * chroma))
+            return "Y4M frame size isn't a yuv420p one of its width and height";
+        uint64_t size = (((uint64_t) work.width << 32) | work.height);
+        uint64_t claimed = 0;
+        if (!framed.compare_exchange_strong(claimed, size) && claimed != size)
+            return "Y4M frames can't change size after the stream header";
+        return nullptr;
+    }
+
+    // Queue some work, waits while its memory is still being written. Returns the errno
+    // of a previous failed write, the work is then dropped, or ECANCELED once sealed
+    int push(Work work) {
+        if (int failed = error.load())
+            return failed;
+
+        if (refused(work) != nullptr)
+            return EINVAL;
+        auto start = chrono::steady_clock::now();
+        bool positional = work.positional();
+
+        if (ring && !positional) {
+            lock_guard<mutex> lock(producer);
+            if (sealed.load())
+                return ECANCELED;
+
+            // Wait for the same memory to be written and for a free slot
+            size_t index = until(work.data);
+            park([this, index, &work] {
+                size_t tail = ring->tail.load();
+                return (tail >= index && room(work.size, ring->head.load() - tail));
+            });
+            if (int failed = error.load())
+                return failed;
+            if (TURBOPIPE_STATS)
+                Stats::add(stats.blocked, Stats::since(start));
+            work.queued = chrono::steady_clock::now();
+            bytes.fetch_add(work.size);
+            ring->push(work);
+
+            if (sleeping.load()) {
+                lock_guard<mutex> wake(this->lock);
+                signal.notify_one();
+            }
+            knock();
+            return 0;
+        }
+
+        // Positional work is tracked by the locked queue, after the same memory left the ring
+        if (ring) {
+            size_t index;
+            {
+                lock_guard<mutex> lock(producer);
+                index = until(work.data);
+            }
+            park([this, index] {
+                return ring->tail.load() >= index;
+            });
+        }
+
+        // Released outside the lock, they might need the GIL
+        vector<Work> dropped;
+        unique_lock<mutex> lock(this->lock);
+
+        /* Notify this memory is queued, wait if pending or full */ {
+            complete.wait(lock, [this, &work, &dropped, positional] {
+                if (sealed.load())
+                    return true;
+                if (options.policy != Policy::FIFO && !positional)
+                    discard(work, dropped);
+                if (queue.find(work.data) != queue.end())
+                    return false;
+                return room(work.size, queue.size());
+            });
+            if (sealed.load())
+                return ECANCELED;
+            if (int failed = error.load())
+                return failed;
+        }
+
+        /* Add another job to the queue */ {
+            if (TURBOPIPE_STATS)
+                Stats::add(stats.blocked, Stats::since(start));
+            work.queued = chrono::steady_clock::now();
+            bytes.fetch_add(work.size);
+            queue.insert(work.data);
+            (positional ? placed : stream).push_back(move(work));
+            lock.unlock();
+        }
+
+        // Others waiting on the discarded memory or for room
+        if (!dropped.empty()) {
+            complete.notify_all();
+            dropped.clear();
+        }
+        if (positional) {
+            placing.notify_one();
+            return 0;
+        }
+        signal.notify_one();
+        knock();
+        return 0;
+    }
+
+    // Worker side, blocks for at least one work, false when closing and drained.
+    // Takes up to the iovecs option of the queued work for a single syscall.
+    // Without blocking, might return an empty batch after a short poll
+    bool next(vector<Work>& batch, bool block=true) {
+        batch.clear();
+
+        if (ring) {
+            for (int spin=0; spin<256 && picked == ring->head.load(); spin++)
+                this_thread::yield();
+
+            if (picked == ring->head.load()) {
+                unique_lock<mutex> lock(this->lock);
+                auto ready = [this] {
+                    return (picked != ring->head.load() || !running);
+                };
+                sleeping.store(true);
+                if (block)
+                    signal.wait(lock, ready);
+                else
+                    signal.wait_for(lock, POLL, ready);
+                sleeping.store(false);
+                if (picked == ring->head.load())
+                    return running;
+            }
+
+            size_t head = ring->head.load();
+            while (picked != head && batch.size() < options.iovecs)
+                batch.push_back(ring->at(picked++));
+            return true;
+        }
+
+        unique_lock<mutex> lock(this->lock);
+        auto ready = [this] {
+            return (!stream.empty() || !running);
+        };
+
+        if (block)
+            signal.wait(lock, ready);
+        else
+            signal.wait_for(lock, POLL, ready);
+
+        // Exit condition, all work was already written
+        if (stream.empty())
+            return running;
+
+        // Get the next work items
+        while (!stream.empty() && batch.size() < options.iovecs) {
+            batch.push_back(move(stream.front()));
+            stream.pop_front();
+        }
+        return true;
+    }
+
+    // Shared engine side, takes up to the iovecs option of the queued work without waiting
+    bool take(vector<Work>& batch) {
+        batch.clear();
+
+        if (ring) {
+            size_t head = ring->head.load();
+            while (picked != head && batch.size() < options.iovecs)
+                batch.push_back(ring->at(picked++));
+            return !batch.empty();
+        }
+
+        lock_guard<mutex> lock(this->lock);
+        while (!stream.empty() && batch.size() < options.iovecs) {
+            batch.push_back(move(stream.front()));
+            stream.pop_front();
+        }
+        return !batch.empty();
+    }
+
+    // Writer side, blocks for some positional work, false when closing and drained
+    bool pick(Work& work) {
+        unique_lock<mutex> lock(this->lock);
+        placing.wait(lock, [this] {
+            return (!placed.empty() || !running);
+        });
+        if (placed.empty())
+            return false;
+        work = move(placed.front());
+        placed.pop_front();
+        return true;
+    }
+
+    // Worker side, the work from next() or pick() was written, releases the batch
+    void done(vector<Work>& batch) {
+        size_t size = 0;
+        bool failed = (error.load() != 0);
+        if (failed) {
+            lock_guard<mutex> lock(this->lock);
+            for (const Work& work: batch)
+                failures.insert(work.data);
+        }
+        for (Work& work: batch) {
+            size += work.size;
+            if (!failed)
+                stats.complete(work);
+
+            // Released outside the lock and before syncs return, it might need the GIL
+            work.keep.reset();
+        }
+        bytes.fetch_sub(size);
+
+        // Positional work is always tracked by the locked queue
+        bool positional = (!batch.empty() && batch[0].positional());
+        if (ring && !positional) {
+            size_t tail = ring->tail.load();
+            for (size_t index=tail; index < (tail + batch.size()); index++)
+                ring->at(index).keep.reset();
+            ring->release(batch.size());
+            batch.clear();
+            if (waiting.load()) {
+                lock_guard<mutex> lock(this->lock);
+                complete.notify_all();
+            }
+            return;
+        }
+
+        lock_guard<mutex> lock(this->lock);
+        for (const Work& work: batch)
+            queue.erase(work.data);
+        batch.clear();
+        complete.notify_all();
+    }
+
+    // Wait for some memory, or all if null, to be written. Returns the errno of a failed
+    // write, of any for all, else once for memory that was then possibly not written
+    int wait(void* data) {
+        if (ring) {
+            size_t index;
+            {
+                lock_guard<mutex> lock(producer);
+                index = until(data);
+            }
+            park([this, index] {
+                return ring->tail.load() >= index;
+            });
+        }
+
+        // Then positional work, the only one in the queue of ring channels
+        unique_lock<mutex> lock(this->lock);
+
+        // Either all empty or some memory not queued (None or specific)
+        complete.wait(lock, [this, data] {
+            if (data != nullptr)
+                return queue.find(data) == queue.end();
+            return queue.empty();
+        });
+        if (data != nullptr)
+            return (failures.erase(data) ? error.load() : 0);
+        return error.load();
+    }
+
+    // Refuse new work, what's queued is still written
+    void seal() {
+        lock_guard<mutex> ring(producer);
+        lock_guard<mutex> lock(this->lock);
+        sealed.store(true);
+        complete.notify_all();
+    }
+
+    // Write everything queued and join the worker and writers
+    void stop() {
+        seal();
+        wait(nullptr);
+        {
+            lock_guard<mutex> lock(this->lock);
+            running = false;
+        }
+        signal.notify_one();
+        placing.notify_all();
+        for (thread& writer: writers)
+            writer.join();
+        writers.clear();
+        if (worker.joinable())
+            worker.join();
+    }
+
+private:
+
+    // Wake the shared engine if it's waiting for completions only
+    void knock() {
+        #ifndef _WIN32
+            if (doorbell >= 0 && armed->exchange(false)) {
+                uint64_t one = 1;
+                ssize_t ignored = ::write(doorbell, &one, sizeof(one));
+                (void) ignored;
+            }
+        #endif
+    }
+
+    // Ring index the tail must reach for some memory, or all, to be written.
+    // Must hold the producer lock, as the ring slots are only stable then
+    size_t until(void* data) {
+        size_t head = ring->head.load();
+        size_t tail = ring->tail.load();
+        if (data == nullptr)
+            return head;
+        for (size_t index=head; index-- > tail;)
+            if (ring->at(index).data == data)
+                return (index + 1);
+        return 0;
+    }
+
+    // Must hold the lock. Takes back frames the worker didn't start so a newer one fits:
+    // the same memory still pending and the oldest ones, or all of them for latest only
+    void discard(const Work& work, vector<Work>& dropped) {
+        auto drop = [this, &dropped](deque<Work>::iterator item) {
+            bytes.fetch_sub(item->size);
+            queue.erase(item->data);
+            Stats::add(stats.dropped, 1);
+            dropped.push_back(move(*item));
+            return stream.erase(item);
+        };
+        for (auto item=stream.begin(); item!=stream.end();) {
+            if (options.policy == Policy::LatestOnly || item->data == work.data)
+                item = drop(item);
+            else
+                item++;
+        }
+        while (!stream.empty() && !room(work.size, queue.size()))
+            drop(stream.begin());
+    }
+
+    // Whether another work fits in the queue along some already queued
+    bool room(size_t size, size_t count) const {
+        if (ring && count >= ring->capacity())
+            return false;
+        if (options.depth && count >= options.depth)
+            return false;
+        if (options.memory && count && (bytes.load() + size) > options.memory)
+            return false;
+        return true;
+    }
+
+    // Spin briefly then sleep until the ring's tail moves enough for some condition
+    template <typename Ready>
+    void park(Ready ready) {
+        for (int spin=0; spin<256; spin++) {
+            if (ready())
+                return;
+            this_thread::yield();
+        }
+
+        unique_lock<mutex> lock(this->lock);
+        waiting.fetch_add(1);
+        complete.wait(lock, ready);
+        waiting.fetch_sub(1);
+    }
+};
+
+constexpr chrono::microseconds Channel::POLL;
+
+// How the worker hands memory to the kernel
+enum class Method: uint8_t {Write, Splice, Send, Zerocopy};
+
+// Bytes taken by a single send, to be acknowledged if zero-copy
+struct Call {size_t bytes; bool zerocopy;};
+
+// Tickets of tracked pipes once done on all their files, with their errno. Event loops
+// watch a file descriptor readable while any is pending, an eventfd or a pipe (Unix)
+class Notifier {
+public:
+    struct Done {uint64_t ticket; int error;};
+
+    ~Notifier() {
+        #ifndef _WIN32
+            if (reader >= 0)
+                ::close(reader);
+            if (writer >= 0 && writer != reader)
+                ::close(writer);
+        #endif
+    }
+
+    // Created on first use, -1 if the platform has none
+    int file() {
+        lock_guard<mutex> lock(this->lock);
+        #if defined(__linux__)
+            if (reader < 0)
+                reader = writer = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        #elif !defined(_WIN32)
+            int ends[2];
+            if (reader < 0 && ::pipe(ends) == 0) {
+                for (int end: ends) {
+                    fcntl(end, F_SETFL, fcntl(end, F_GETFL) | O_NONBLOCK);
+                    fcntl(end, F_SETFD, FD_CLOEXEC);
+                }
+                reader = ends[0];
+                writer = ends[1];
+            }
+        #endif
+        if (!done.empty())
+            signal();
+        return reader;
+    }
+
+    void complete(uint64_t ticket, int error) {
+        lock_guard<mutex> lock(this->lock);
+        if (cancelled.erase(ticket))
+            return;
+        done.push_back({ticket, error});
+        signal();
+    }
+
+    // Nobody awaits a ticket whose pipe failed, forget its completion, done or not
+    void cancel(uint64_t ticket) {
+        lock_guard<mutex> lock(this->lock);
+        for (auto it=done.begin(); it!=done.end(); it++) {
+            if (it->ticket == ticket) {
+                done.erase(it);
+                return;
+            }
+        }
+        cancelled.insert(ticket);
+    }
+
+    // Everything done since the last call, the file is no longer readable
+    vector<Done> drain() {
+        vector<Done> drained;
+        lock_guard<mutex> lock(this->lock);
+        drained.swap(done);
+        #ifndef _WIN32
+            if (signalled) {
+                uint64_t count;
+                ssize_t ignored = ::read(reader, &count, sizeof(count));
+                (void) ignored;
+                signalled = false;
+            }
+        #endif
+        return drained;
+    }
+
+private:
+    vector<Done> done;
+    unordered_set<uint64_t> cancelled;
+    bool signalled = false;
+    int reader = -1;
+    int writer = -1;
+    mutex lock;
+
+    // Must hold the lock. A single write until drained
+    void signal() {
+        #ifndef _WIN32
+            if (writer < 0 || signalled)
+                return;
+            uint64_t one = 1;
+            signalled = (::write(writer, &one, (reader == writer ? sizeof(one) : 1)) > 0);
+        #endif
+    }
+};
+
+class TurboPipe {
+public:
+    TurboPipe() {}
+    ~TurboPipe() {close();}
+
+    // Channel of the writes to paths, as a file descriptor for configure() and stats()
+    static constexpr int PATHS = -1;
+
+    // Completions of tracked pipes
+    Notifier notifier;
+
+    #ifndef TURBOPIPE_NO_PYTHON
+
+    // Writes a held buffer, its reference is kept until written or just for copies. Not keeping
+    // it releases the exporter once queued by the calling thread, only the address is tracked
+    int pipe(shared_ptr<void> held, const vector<int>& files, bool copy=false, Work work=Work(), uint64_t* ticket=nullptr, bool keep=true) {
+        Py_buffer* buffer = (Py_buffer*) held.get();
+        work.data = buffer->buf;
+        work.size = buffer->len;
+        if (!copy && keep)
+            work.keep = held;
+        int error;
+
+        // Might wait for the same memory to be written, let other threads run
+        Py_BEGIN_ALLOW_THREADS
+        error = this->_pipe(work, files, copy, ticket);
+        Py_END_ALLOW_THREADS
+        return error;
+    }
+
+    // Negative if the view isn't a buffer, else the errno of a failed write
+    int sync(PyObject* view=nullptr) {
+        int error;
+        void* data = nullptr;
+
+        // Only the address matters, the exporter was held while queued
+        if (view != nullptr) {
+            Py_buffer temp;
+            if (PyObject_GetBuffer(view, &temp, PyBUF_SIMPLE) < 0)
+                return -1;
+            data = temp.buf;
+            PyBuffer_Release(&temp);
+        }
+
+        Py_BEGIN_ALLOW_THREADS
+        error = this->_sync(data);
+        Py_END_ALLOW_THREADS
+        return error;
+    }
+
+    // Own an exporter's buffer, released with the GIL by whichever thread drops it last. Workers
+    // take the GIL once per held frame for it, copies and unkept buffers never do
+    static shared_ptr<void> hold(Py_buffer* buffer) {
+        return shared_ptr<void>(buffer, [](void* pointer) {
+            Py_buffer* buffer = (Py_buffer*) pointer;
+            if (Py_IsInitialized()) {
+                PyGILState_STATE state = PyGILState_Ensure();
+                PyBuffer_Release(buffer);
+                PyGILState_Release(state);
+            }
+            delete buffer;
+        });
+    }
+
+    #endif
+
+    // Queue the same work to many files, each written by their own worker in parallel.
+    // Copying queues a single staging block shared by all, released when all are done,
+    // the memory can be reused right away. Returns the errno of a failed write on any
+    int _pipe(Work work, const vector<int>& files, bool copy=false, uint64_t* ticket=nullptr) {
+        // Paths are the only work of their channel, it has no file nor worker to write others
+        for (int file: files)
+            if (file < 0 && (file != PATHS || work.path.empty()))
+                return EBADF;
+
+        vector<shared_ptr<Channel>> targets;
+        for (int file: files)
+            targets.push_back(this->channel(file));
+        if (targets.empty())
+            return 0;
+
+        if (copy) {
+            void* block;
+            auto start = chrono::steady_clock::now();
+            work.keep = targets[0]->pool->acquire(work.size, &block);
+            if (block == nullptr)
+                return ENOMEM;
+            if (TURBOPIPE_STATS)
+                Stats::add(targets[0]->stats.blocked, Stats::since(start));
+            helpers.copy(block, work.data, work.size, targets[0]->options.copiers);
+            work.data = block;
+        }
+
+        // Tracking outlives every copy of the work, notified when the last one is released
+        if (ticket != nullptr) {
+            uint64_t id = *ticket = ++tickets;
+            shared_ptr<void> keep = work.keep;
+            work.keep = shared_ptr<void>(nullptr, [this, id, keep, targets](void*) {
+                int error = 0;
+                for (const auto& target: targets)
+                    if (!error)
+                        error = target->error.load();
+                notifier.complete(id, error);
+            });
+        }
+
+        int error = 0;
+        for (size_t index=0; index<targets.size(); index++) {
+            work.file = files[index];
+
+            // Positional writers start with their first work. A channel configured or
+            // closed meanwhile refuses it, its replacement takes it after the drain
+            int failed;
+            while (true) {
+                if (work.positional())
+                    writing(targets[index]);
+                if ((failed = targets[index]->push(work)) != ECANCELED)
+                    break;
+                targets[index] = this->channel(files[index]);
+            }
+            if (!error)
+                error = failed;
+        }
+
+        // The caller gets the error instead of a ticket
+        if (error && ticket != nullptr)
+            notifier.cancel(*ticket);
+        return error;
+    }
+
+    // Returns the errno of the first failed write on any file
+    int _sync(void* data=nullptr) {
+        vector<shared_ptr<Channel>> waiting;
+        {
+            lock_guard<mutex> lock(registry);
+            for (auto& pair: channels)
+                waiting.push_back(pair.second);
+        }
+
+        // Wait for some or all queues to be empty, as they are erased when
+        // each thread's writing loop is done, guaranteeing finish
+        int error = 0;
+        for (auto& channel: waiting) {
+            int failed = channel->wait(data);
+            if (!error)
+                error = failed;
+        }
+        return error;
+    }
+
+    void close() {
+        _sync();
+
+        // Those retiring already are left to their configure()
+        vector<pair<int, shared_ptr<Channel>>> retired;
+        {
+            lock_guard<mutex> lock(registry);
+            for (auto& pair: channels) {
+                if (pair.second->sealed.load())
+                    continue;
+                pair.second->seal();
+                retired.push_back(pair);
+            }
+        }
+
+        // Drain and join every worker outside the registry, new pipes will start fresh channels
+        for (auto& pair: retired)
+            retire(pair.second);
+        lock_guard<mutex> lock(registry);
+        for (auto& pair: retired)
+            channels.erase(pair.first);
+        replaced.notify_all();
+    }
+
+    // Replace the options of a file descriptor, writes queued so far finish first.
+    // Its pipes wait for the drain, other files' don't
+    Options configure(int file, Options options) {
+        shared_ptr<Channel> previous;
+        {
+            unique_lock<mutex> lock(registry);
+            previous = settled(lock, file);
+            if (previous == nullptr)
+                return start(file, options)->options;
+            previous->seal();
+        }
+
+        retire(previous);
+        lock_guard<mutex> lock(registry);
+        channels.erase(file);
+        Options effective = start(file, options)->options;
+        replaced.notify_all();
+        return effective;
+    }
+
+    // Current options of a file descriptor, the defaults if never piped to
+    Options options(int file) {
+        lock_guard<mutex> lock(registry);
+        auto found = channels.find(file);
+        if (found != channels.end())
+            return found->second->options;
+        return Options();
+    }
+
+    // Why a file's framing can't carry some work, null if all can, see Channel::refused()
+    const char* refused(const Work& work, const vector<int>& files) {
+        lock_guard<mutex> lock(registry);
+        for (int file: files) {
+            auto found = channels.find(file);
+            if (found == channels.end())
+                continue;
+            if (const char* reason = found->second->refused(work))
+                return reason;
+        }
+        return nullptr;
+    }
+
+    // Every file descriptor piped to and its channel, for reporting
+    vector<pair<int, shared_ptr<Channel>>> active() {
+        lock_guard<mutex> lock(registry);
+        return vector<pair<int, shared_ptr<Channel>>>(channels.begin(), channels.end());
+    }
+
+private:
+    // Python threads pipe without the GIL, only this lock guards the map
+    unordered_map<int, shared_ptr<Channel>> channels;
+    mutex registry;
+
+    // A sealed channel left the map, only whoever sealed it erases or replaces it
+    condition_variable replaced;
+    Helpers helpers;
+    atomic<uint64_t> tickets{0};
+
+    #ifdef TURBOPIPE_URING
+        class Uring;
+        unique_ptr<Uring> uring;
+    #endif
+
+    // Y4M stream headers written to files, outliving their channels. The same file
+    // gets a new one only once its frames change, an fd reused for another file does
+    struct Header {uint64_t device, inode, size; uint32_t rate[2];};
+    unordered_map<int, Header> headers;
+    mutex heading;
+
+    // Whether the Y4M stream of a file needs a header, recording it as written
+    bool announce(int file, uint32_t width, uint32_t height, const uint32_t rate[2]) {
+        Header header = {0, 0, (((uint64_t) width << 32) | height), {rate[0], rate[1]}};
+        #ifndef _WIN32
+            struct stat info;
+            if (fstat(file, &info) == 0) {
+                header.device = info.st_dev;
+                header.inode = info.st_ino;
+            }
+        #endif
+        lock_guard<mutex> lock(heading);
+        auto found = headers.find(file);
+        if (found != headers.end() && memcmp(&found->second, &header, sizeof(header)) == 0)
+            return false;
+        headers[file] = header;
+        return true;
+    }
+
+    // Must hold the registry lock. Each channel has its own thread, or the shared
+    // io_uring engine when asked for and available, except for compressed or framed ones.
+    // Paths only have positional writers
+    shared_ptr<Channel> start(int file, Options options) {
+        shared_ptr<Channel> channel = make_shared<Channel>(file, options);
+        channels[file] = channel;
+
+        // Other framings end a Y4M stream, the next one starts over
+        if (options.framing != Framing::Y4M) {
+            lock_guard<mutex> lock(heading);
+            headers.erase(file);
+        }
+        if (file == PATHS) {
+            channel->options.uring = false;
+            return channel;
+        }
+
+        #ifdef TURBOPIPE_URING
+            if (options.uring && options.compress == Codec::None && options.framing == Framing::None) {
+                if (!uring)
+                    uring.reset(new Uring());
+                if (uring->attach(channel.get()))
+                    return channel;
+            }
+        #endif
+
+        channel->options.uring = false;
+        channel->worker = thread(&TurboPipe::worker, this, channel.get());
+        return channel;
+    }
+
+    // Must not hold the registry lock, the drain can be long. Drains a channel its caller
+    // sealed, producers wait in settled() meanwhile, the caller unlinks it afterwards
+    void retire(shared_ptr<Channel>& channel) {
+        channel->stop();
+        #ifdef TURBOPIPE_URING
+            if (channel->options.uring)
+                uring->detach(channel.get());
+        #endif
+    }
+
+    // Find or create the channel of a file descriptor
+    shared_ptr<Channel> channel(int file) {
+        unique_lock<mutex> lock(registry);
+        if (shared_ptr<Channel> found = settled(lock, file))
+            return found;
+        return start(file, Options());
+    }
+
+    // Must hold the registry lock, released while a sealed channel of the file retires.
+    // The channel of a file once its sealer unlinked or replaced it, null if none
+    shared_ptr<Channel> settled(unique_lock<mutex>& lock, int file) {
+        replaced.wait(lock, [this, file] {
+            auto found = channels.find(file);
+            return (found == channels.end() || !found->second->sealed.load());
+        });
+        auto found = channels.find(file);
+        return (found != channels.end() ? found->second : nullptr);
+    }
+
+    // Start the positional writers of a channel if not yet, not once sealed as stop() joins them
+    void writing(const shared_ptr<Channel>& channel) {
+        lock_guard<mutex> lock(registry);
+        while (!channel->sealed.load() && channel->writers.size() < channel->options.writers)
+            channel->writers.push_back(thread(&TurboPipe::writer, this, channel.get()));
+    }
+
+    // Positional writes of a channel, many in parallel as the kernel orders nothing.
+    // Aligned frames go through an O_DIRECT open of the same file when asked for
+    void writer(Channel* channel) {
+        place(channel->options.cpus, channel->options.priority);
+        vector<uint8_t> scratch;
+        vector<iovec> iov;
+        vector<Work> batch;
+        Work work;
+
+        // Opened on the first aligned frame, if the file allows
+        int direct = -1;
+        #ifdef __linux__
+            bool reopened = false;
+        #endif
+
+        while (channel->pick(work)) {
+            if (!channel->error.load()) {
+                int error = 0;
+                char* data = (char*) prepare(work, scratch);
+                size_t bytes = size(work);
+
+                iov.clear();
+                if (flipped(work)) {
+                    size_t stride = (bytes / work.height);
+                    for (size_t row=work.height; row-- > 0;)
+                        iov.push_back({data + row * stride, stride});
+                } else {
+                    iov.push_back({data, bytes});
+                }
+                repeat(iov, 0, work.repeat);
+
+                int64_t offset = max(work.offset, (int64_t) 0);
+                bool bypass = (channel->options.direct && aligned(iov, offset));
+                if (!work.path.empty()) {
+                    error = pwritepath(work.path, iov, offset, bypass, &channel->stats);
+                } else {
+                    #ifdef __linux__
+                        if (bypass && !reopened) {
+                            direct = reopen(work.file);
+                            reopened = true;
+                        }
+                    #endif
+                    error = pwriteall(((bypass && direct >= 0) ? direct : work.file), iov, offset, &channel->stats);
+                }
+                if (error)
+                    channel->error.store(error);
+            }
+            batch.push_back(move(work));
+            channel->done(batch);
+        }
+        #ifdef __linux__
+            if (direct >= 0)
+                ::close(direct);
+        #endif
+    }
+
+    void worker(Channel* channel) {
+        place(channel->options.cpus, channel->options.priority);
+        vector<Work> batch;
+        bool block = true;
+
+        // Converted frames are written from here
+        vector<uint8_t> scratch;
+        vector<size_t> sizes;
+
+        // Compressed frames are written from its memory
+        Packer packer;
+        bool packing = (channel->options.compress != Codec::None);
+
+        // Headers of the stream and each frame, before their payload in the same write
+        Framer framer;
+        Framing framing = channel->options.framing;
+
+        Chunk chunk(channel->options.chunk);
+        vector<iovec> iov;
+
+        Method flush = (channel->socket ? Method::Send : Method::Write);
+        Method method = flush;
+        if (channel->options.splice)
+            method = Method::Splice;
+        if (channel->options.zerocopy)
+            method = Method::Zerocopy;
+
+        #ifdef __linux__
+            // Spliced pages are only released once the reader consumes them,
+            // and zero-copy ones once the kernel notifies the send is done
+            struct Spliced {Work work; size_t end;};
+            deque<Spliced> spliced;
+            vector<Work> consumed;
+            size_t total = 0;
+            bool deferred = (channel->options.splice || channel->options.zerocopy);
+            Tee tee;
+        #endif
+
+        #ifdef TURBOPIPE_ZEROCOPY
+            // Every zero-copy send is numbered, the kernel acknowledges ranges of them
+            struct Pending {size_t end; size_t id;};
+            deque<Pending> pending;
+            vector<Call> calls;
+            vector<Call>* record = (channel->options.zerocopy ? &calls : nullptr);
+            size_t completed = 0;
+            size_t sent = 0;
+            size_t next = 0;
+            size_t acked = 0;
+            map<size_t, size_t> early;
+        #else
+            vector<Call>* record = nullptr;
+        #endif
+
+        while (channel->next(batch, block)) {
+
+            // Discard all work after an error, no one is reading it
+            if (!batch.empty() && !channel->error.load()) {
+                int error = 0;
+                sizes.clear();
+
+                // Optimization: Send all queued frames in as few syscalls as possible
+                iov.clear();
+                framer.reset(batch.size());
+                bool scratched = false;
+                for (const Work& work: batch) {
+
+                    // Scratch memory is reused, flush what already points to it
+                    if ((work.into != Format::None || packing) && scratched) {
+                        if ((error = writeall(work.file, iov, chunk, flush, record, &channel->stats)))
+                            break;
+                        scratched = false;
+                        iov.clear();
+                    }
+
+                    char* data = (char*) prepare(work, scratch, packing);
+                    scratched |= (data == (char*) scratch.data());
+                    sizes.push_back(size(work));
+                    if (framer.fresh(framing, work.width, work.height)
+                        && announce(work.file, work.width, work.height, channel->options.rate))
+                        iov.push_back(framer.stream(work.width, work.height, channel->options.rate));
+                    size_t begin = iov.size();
+
+                    if (packing) {
+                        const char* packed;
+                        sizes.back() = pack(channel, packer, data, sizes.back(), &packed);
+                        iov.push_back({(void*) packed, sizes.back()});
+                        scratched = true;
+
+                    // Flipping is free as one buffer per row in reverse order
+                    } else if (flipped(work)) {
+                        size_t stride = (sizes.back() / work.height);
+                        for (size_t row=work.height; row-- > 0;)
+                            iov.push_back({data + row * stride, stride});
+                    } else {
+                        iov.push_back({data, sizes.back()});
+                    }
+
+                    // Repeated frames get their header each time
+                    if (framing != Framing::None) {
+                        iovec header = framer.frame(framing, sizes.back(), work.pts, work.width, work.height);
+                        iov.insert(iov.begin() + begin, header);
+                        sizes.back() += header.iov_len;
+                    }
+
+                    if (work.repeat > 1) {
+                        #ifdef __linux__
+                            // Copied once into a private pipe then duplicated, spliced pages are free already
+                            if (method == Method::Write && channel->options.pipesize > 0 && tee.fits(sizes.back())) {
+                                vector<iovec> frame(iov.begin() + begin, iov.end());
+                                iov.resize(begin);
+                                if ((error = writeall(work.file, iov, chunk, flush, record, &channel->stats)))
+                                    break;
+                                if ((error = tee.repeat(work.file, frame, work.repeat, &channel->stats)))
+                                    break;
+                                sizes.back() *= work.repeat;
+                                scratched = false;
+                                iov.clear();
+                                continue;
+                            }
+                        #endif
+                        repeat(iov, begin, work.repeat);
+                        sizes.back() *= work.repeat;
+                    }
+                }
+
+                // Never splice or zero-copy scratch memory, it changes on the next frame
+                if (!error)
+                    error = writeall(batch[0].file, iov, chunk, (scratched ? flush : method), record, &channel->stats);
+
+                if (error)
+                    channel->error.store(error);
+
+                #ifdef TURBOPIPE_ZEROCOPY
+                    // Plain sends are done right away, after the previous ones
+                    for (const Call& call: calls)
+                        pending.push_back({sent += call.bytes, (call.zerocopy ? next++ : SIZE_MAX)});
+                    calls.clear();
+                #endif
+
+                #ifdef __linux__
+                    if (deferred && !error) {
+                        for (size_t index=0; index<batch.size(); index++)
+                            spliced.push_back({batch[index], total += sizes[index]});
+                        batch.clear();
+                    }
+                #endif
+            }
+
+            channel->done(batch);
+
+            #ifdef __linux__
+                // Complete the frames no longer in the pipe or sent, or all if it broke
+                if (!spliced.empty()) {
+                    int file = spliced.front().work.file;
+                    size_t finished = total;
+
+                    if (channel->options.splice) {
+                        int unread = 0;
+                        pollfd status = {file, POLLOUT, 0};
+                        if (poll(&status, 1, 0) > 0 && (status.revents & POLLERR))
+                            channel->error.store(EPIPE);
+                        if (channel->error.load() || ioctl(file, FIONREAD, &unread) < 0)
+                            unread = 0;
+                        finished = (total - unread);
+                    }
+
+                    #ifdef TURBOPIPE_ZEROCOPY
+                        if (channel->options.zerocopy) {
+                            if (int failed = reap(file, acked, early))
+                                channel->error.store(failed);
+                            if (channel->error.load())
+                                pending.clear();
+                            while (!pending.empty() && (pending.front().id == SIZE_MAX || pending.front().id < acked)) {
+                                completed = pending.front().end;
+                                pending.pop_front();
+                            }
+                            finished = (channel->error.load() ? total : completed);
+                        }
+                    #endif
+
+                    consumed.clear();
+                    while (!spliced.empty() && spliced.front().end <= finished) {
+                        consumed.push_back(spliced.front().work);
+                        spliced.pop_front();
+                    }
+                    channel->done(consumed);
+                }
+                block = spliced.empty();
+            #endif
+        }
+    }
+
+    // Bytes actually written for some work
+    static size_t size(const Work& work) {
+        if (work.into != Format::None)
+            return converted(work.from, work.into, work.width, work.height);
+        return work.size;
+    }
+
+    // Memory to be written for some work, converting it into the scratch if needed.
+    // Contiguous also reverses flipped rows there, not as separate buffers
+    static void* prepare(const Work& work, vector<uint8_t>& scratch, bool contiguous=false) {
+        if (contiguous && flipped(work)) {
+            size_t stride = (work.size / work.height);
+            scratch.resize(work.size);
+            for (size_t row=0; row<work.height; row++)
+                memcpy(scratch.data() + row * stride, (char*) work.data + (work.height - 1 - row) * stride, stride);
+            return scratch.data();
+        }
+        if (work.into == Format::None)
+            return work.data;
+        scratch.resize(size(work));
+        convert(work.from, work.into, work.data, scratch.data(), work.width, work.height, work.flip);
+        return scratch.data();
+    }
+
+    // Compress some prepared memory with the channel's codec, returns the framed size
+    static size_t pack(Channel* channel, Packer& packer, const char* data, size_t size, const char** packed) {
+        const Options& options = channel->options;
+        return packer.pack(options.compress, options.level, data, size, options.compressors, packed);
+    }
+
+    // Whether rows are still to be reversed while writing, conversions already flip them
+    static bool flipped(const Work& work) {
+        return (work.flip && work.into == Format::None && work.height > 1);
+    }
+
+    // Whether O_DIRECT takes some buffers at an offset, all in multiples of pages
+    static bool aligned(const vector<iovec>& iov, int64_t offset) {
+        if (offset % Pool::ALIGN)
+            return false;
+        for (const iovec& buffer: iov)
+            if (((uintptr_t) buffer.iov_base % Pool::ALIGN) || (buffer.iov_len % Pool::ALIGN))
+                return false;
+        return true;
+    }
+
+    // Append the buffers from some index again, until written count times
+    static void repeat(vector<iovec>& iov, size_t begin, size_t count) {
+        size_t end = iov.size();
+        iov.reserve(end + (end - begin) * (count - 1));
+        for (size_t time=1; time<count; time++)
+            for (size_t index=begin; index<end; index++)
+                iov.push_back(iov[index]);
+    }
 
-using namespace std;
+    #ifndef _WIN32
 
-// ------------------------------------------------------------------------------------------------|
-// TurboPipe internals
+    // Vectored write of a whole list, at most some chunk bytes per syscall.
+    // Splicing maps the pages into the pipe instead of copying them, sockets
+    // might do the same with zero-copy sends, recording each call. Retries
+    // interrupted and non-blocking writes, returns the errno of a failure
+    static int writeall(int file, vector<iovec>& iov, Chunk& chunk, Method method=Method::Write, vector<Call>* record=nullptr, Stats* stats=nullptr) {
+        size_t first = 0;
+        bool zerocopy = (method == Method::Zerocopy);
 
-struct Work {
-    void*  data;
-    size_t size;
-    int    file;
-};
+        while (first < iov.size()) {
+            size_t count = 0;
+            size_t bytes = 0;
 
-class TurboPipe {
-public:
-    TurboPipe(): running(true) {}
-    ~TurboPipe() {close();}
+            // Select as many buffers as fit in the chunk
+            while ((first + count) < iov.size() && count < IOV_MAX && bytes < chunk.size)
+                bytes += iov[first + count++].iov_len;
+
+            // Temporarily trim the last buffer to the chunk size
+            iovec& last = iov[first + count - 1];
+            size_t length = last.iov_len;
+            if (bytes > chunk.size) {
+                last.iov_len -= (bytes - chunk.size);
+                bytes = chunk.size;
+            }
+
+            ssize_t written;
+            if (method == Method::Send || method == Method::Zerocopy) {
+                msghdr message = {};
+                message.msg_iov = &iov[first];
+                message.msg_iovlen = count;
+                int flags = 0;
+                #ifdef MSG_NOSIGNAL
+                    flags |= MSG_NOSIGNAL;
+                #endif
+                #ifdef TURBOPIPE_ZEROCOPY
+                    if (zerocopy)
+                        flags |= MSG_ZEROCOPY;
+                #endif
+                written = sendmsg(file, &message, flags);
+            #ifdef __linux__
+            } else if (method == Method::Splice) {
+                written = vmsplice(file, &iov[first], count, 0);
+            #endif
+            } else {
+                written = writev(file, &iov[first], count);
+            }
+            last.iov_len = length;
+
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
 
-    void pipe(PyObject* view, int file) {
-        Py_buffer data = *PyMemoryView_GET_BUFFER(view);
-        this->_pipe({data.buf, (size_t) data.len, file});
+                // Out of memory for notifications, copy this one
+                if (zerocopy && errno == ENOBUFS) {
+                    zerocopy = false;
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    pollfd ready = {file, POLLOUT, 0};
+                    poll(&ready, 1, -1);
+                    continue;
+                }
+                return errno;
+            }
+            chunk.update(bytes, written);
+            if (stats != nullptr)
+                stats->write(bytes, written);
+            if (record != nullptr)
+                record->push_back({(size_t) written, zerocopy});
+            zerocopy = (method == Method::Zerocopy);
+
+            // Skip fully written buffers, advance partial ones
+            size_t left = written;
+            while (first < iov.size() && left >= iov[first].iov_len)
+                left -= iov[first++].iov_len;
+            if (left > 0) {
+                iov[first].iov_base = (char*) iov[first].iov_base + left;
+                iov[first].iov_len -= left;
+            }
+        }
+        return 0;
     }
 
-    void sync(PyObject* view=nullptr) {
-        void* data = nullptr;
+    // Positional write of a whole list at some offset, retrying interrupted and partial
+    // ones. Returns the errno of a failure, regular files never block
+    static int pwriteall(int file, vector<iovec>& iov, int64_t offset, Stats* stats=nullptr) {
+        size_t first = 0;
+        while (first < iov.size()) {
+            size_t bytes = 0;
+            #ifdef __linux__
+                int count = (int) min(iov.size() - first, (size_t) IOV_MAX);
+                for (int index=0; index<count; index++)
+                    bytes += iov[first + index].iov_len;
+                ssize_t written = pwritev(file, &iov[first], count, (off_t) offset);
+            #else
+                bytes = iov[first].iov_len;
+                ssize_t written = pwrite(file, iov[first].iov_base, bytes, (off_t) offset);
+            #endif
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                return errno;
+            }
+            if (stats != nullptr)
+                stats->write(bytes, written);
+            offset += written;
 
-        if (view != nullptr) {
-            Py_buffer temp = *PyMemoryView_GET_BUFFER(view);
-            data = temp.buf;
+            // Skip fully written buffers, advance partial ones
+            size_t left = written;
+            while (first < iov.size() && left >= iov[first].iov_len)
+                left -= iov[first++].iov_len;
+            if (left > 0) {
+                iov[first].iov_base = (char*) iov[first].iov_base + left;
+                iov[first].iov_len -= left;
+            }
         }
+        return 0;
+    }
 
-        this->_sync(data);
+    // Write a new file at some path, created or truncated, maybe skipping the page cache
+    static int pwritepath(const string& path, vector<iovec>& iov, int64_t offset, bool direct, Stats* stats=nullptr) {
+        (void) direct;
+        int flags = (O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC);
+        int file = -1;
+
+        // Some filesystems, like tmpfs, refuse direct writes
+        #ifdef O_DIRECT
+            if (direct)
+                file = open(path.c_str(), (flags | O_DIRECT), 0666);
+        #endif
+        if (file < 0)
+            file = open(path.c_str(), flags, 0666);
+        if (file < 0)
+            return errno;
+        int error = pwriteall(file, iov, offset, stats);
+        if (::close(file) != 0 && !error)
+            error = errno;
+        return error;
     }
 
-    void close() {
-        sync();
-        running = false;
-        signal.notify_all();
-        for (auto& pair: threads)
-            pair.second.join();
-        threads.clear();
+    #ifdef __linux__
+
+    // Another open file description of a file skipping the page cache, -1 if refused
+    static int reopen(int file) {
+        char path[32];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", file);
+        int flags = fcntl(file, F_GETFL);
+        if (flags < 0 || (flags & O_ACCMODE) == O_RDONLY)
+            return -1;
+        return open(path, (O_WRONLY | O_DIRECT | O_CLOEXEC));
     }
 
-private:
-    unordered_map<int, unordered_map<void*, condition_variable>> pending;
-    unordered_map<int, unordered_set<void*>> queue;
-    unordered_map<int, deque<Work>> stream;
-    unordered_map<int, thread> threads;
-    unordered_map<int, mutex> mutexes;
-    condition_variable signal;
-    bool running;
+    #endif
 
-    void _pipe(Work work) {
-        unique_lock<mutex> lock(mutexes[work.file]);
+    #else
 
-        /* Notify this memory is queued, wait if pending */ {
-            if (!queue[work.file].insert(work.data).second) {
-                pending[work.file][work.data].wait(lock, [this, work] {
-                    return queue[work.file].find(work.data) == queue[work.file].end();
-                });
+    // Native writes of each buffer, at most some chunk bytes per call. Pipes go through
+    // an OVERLAPPED with an event, waiting on pending writes of overlapped handles and
+    // looping on partial ones. Files are synchronous, an overlapped write needs offsets
+    static int writeall(int file, vector<iovec>& iov, Chunk& chunk, Method method=Method::Write, vector<Call>* record=nullptr, Stats* stats=nullptr) {
+        (void) method;
+        (void) record;
+        HANDLE handle = (HANDLE) _get_osfhandle(file);
+        if (handle == INVALID_HANDLE_VALUE)
+            return EBADF;
+        bool disk = (GetFileType(handle) == FILE_TYPE_DISK);
+
+        // Each worker keeps its own event
+        static thread_local unique_ptr<void, BOOL (WINAPI*)(HANDLE)> event(
+            CreateEventW(nullptr, TRUE, FALSE, nullptr), CloseHandle);
+        if (!disk && event.get() == nullptr)
+            return errnum(GetLastError());
+
+        for (const iovec& buffer: iov) {
+            const char* data = (const char*) buffer.iov_base;
+            size_t left = buffer.iov_len;
+
+            while (left > 0) {
+                DWORD bytes = (DWORD) min(min(left, chunk.size), (size_t) (1 << 30));
+                DWORD written = 0;
+                BOOL done;
+
+                if (disk) {
+                    done = WriteFile(handle, data, bytes, &written, nullptr);
+                } else {
+                    OVERLAPPED overlapped = {};
+                    overlapped.hEvent = event.get();
+                    ResetEvent(overlapped.hEvent);
+                    done = WriteFile(handle, data, bytes, &written, &overlapped);
+                    if (!done && GetLastError() == ERROR_IO_PENDING)
+                        done = GetOverlappedResult(handle, &overlapped, &written, TRUE);
+                }
+                if (!done)
+                    return errnum(GetLastError());
+
+                chunk.update(bytes, written);
+                if (stats != nullptr)
+                    stats->write(bytes, written);
+                data += written;
+                left -= written;
             }
         }
+        return 0;
+    }
 
-        /* Add another job to the queue */ {
-            stream[work.file].push_back(work);
-            queue[work.file].insert(work.data);
-            this->running = true;
-            lock.unlock();
+    // Positional writes of each buffer through an OVERLAPPED at its offset, synchronous
+    // on the CRT's handles. Returns the errno of a failure
+    static int pwriteall(int file, vector<iovec>& iov, int64_t offset, Stats* stats=nullptr) {
+        HANDLE handle = (HANDLE) _get_osfhandle(file);
+        if (handle == INVALID_HANDLE_VALUE)
+            return EBADF;
+
+        for (const iovec& buffer: iov) {
+            const char* data = (const char*) buffer.iov_base;
+            size_t left = buffer.iov_len;
+
+            while (left > 0) {
+                DWORD bytes = (DWORD) min(left, (size_t) (1 << 30));
+                DWORD written = 0;
+                OVERLAPPED overlapped = {};
+                overlapped.Offset = (DWORD) offset;
+                overlapped.OffsetHigh = (DWORD) (offset >> 32);
+                BOOL done = WriteFile(handle, data, bytes, &written, &overlapped);
+                if (!done && GetLastError() == ERROR_IO_PENDING)
+                    done = GetOverlappedResult(handle, &overlapped, &written, TRUE);
+                if (!done)
+                    return errnum(GetLastError());
+
+                if (stats != nullptr)
+                    stats->write(bytes, written);
+                data += written;
+                left -= written;
+                offset += written;
+            }
         }
+        return 0;
+    }
 
-        // Each file descriptor has its own thread
-        if (threads.find(work.file) == threads.end())
-            threads[work.file] = thread(&TurboPipe::worker, this, work.file);
+    // Write a new file at some UTF-8 path, created or truncated, always through the cache
+    static int pwritepath(const string& path, vector<iovec>& iov, int64_t offset, bool direct, Stats* stats=nullptr) {
+        (void) direct;
+        int length = MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, nullptr, 0);
+        if (length <= 0)
+            return EINVAL;
+        vector<wchar_t> wide(length);
+        MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, wide.data(), length);
 
-        signal.notify_all();
+        int file = _wopen(wide.data(), (_O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY | _O_NOINHERIT), (_S_IREAD | _S_IWRITE));
+        if (file < 0)
+            return errno;
+        int error = pwriteall(file, iov, offset, stats);
+        if (_close(file) != 0 && !error)
+            error = errno;
+        return error;
     }
+    #endif
 
-    void _sync(void* data=nullptr) {
-        // Wait for some or all queues to be empty, as they are erased when
-        // each thread's writing loop is done, guaranteeing finish
-        for (auto& values: queue) {
-            while (true) {
-                {
-                    // Prevent segfault on iteration on changing data
-                    lock_guard<mutex> lock(mutexes[values.first]);
+    #ifdef TURBOPIPE_ZEROCOPY
 
-                    // Either all empty or some memory not queued (None or specific)
-                    if (data != nullptr && values.second.find(data) == values.second.end())
-                        break;
-                    if (data == nullptr && values.second.empty())
-                        break;
+    // Collect the kernel's notifications of zero-copy sends done with their pages, ranges
+    // that might be coalesced or out of order. Acknowledges all numbered below some count
+    // once done without gaps, later ranges wait in early. Returns the errno of a failed one
+    static int reap(int file, size_t& acked, map<size_t, size_t>& early) {
+        char control[128];
+        while (true) {
+            msghdr message = {};
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+            if (recvmsg(file, &message, MSG_ERRQUEUE) < 0)
+                return 0;
+            for (cmsghdr* header=CMSG_FIRSTHDR(&message); header; header=CMSG_NXTHDR(&message, header)) {
+                sock_extended_err* notice = (sock_extended_err*) CMSG_DATA(header);
+                if (notice->ee_origin == SO_EE_ORIGIN_ZEROCOPY) {
+                    size_t& end = early[notice->ee_info];
+                    end = max(end, (size_t) notice->ee_data + 1);
+                } else if (notice->ee_errno) {
+                    return notice->ee_errno;
                 }
-                this_thread::sleep_for(chrono::microseconds(200));
+            }
+            while (!early.empty() && early.begin()->first <= acked) {
+                acked = max(acked, early.begin()->second);
+                early.erase(early.begin());
             }
         }
     }
 
-    void worker(int file) {
-        while (this->running) {
-            unique_lock<mutex> lock(mutexes[file]);
+    #endif
 
-            signal.wait(lock, [this, file] {
-                return (!stream[file].empty() || !this->running);
-            });
+    #ifdef __linux__
 
-            // Skip on false positives, exit condition
-            if (stream[file].empty()) continue;
-            if (!this->running) break;
+    // Repeats frames into pipes from private ones holding a single copy of them, tee()
+    // duplicates their pages without consuming them and the last time splices them out.
+    // Frames larger than a pipe's maximum size are spread over as many as needed
+    class Tee {
+    public:
+        static constexpr size_t PIPES = 64; // Most private pipes, two descriptors each
 
-            // Get the next work item
-            Work work = stream[file].front();
-            stream[file].pop_front();
-            lock.unlock();
+        ~Tee() {close();}
 
-            #ifdef _WIN32
-                // Windows doesn't like chunked writes ??
-                write(work.file, (char*) work.data, work.size);
-            #else
-                // Optimization: Write in chunks of 4096 (RAM page size)
-                size_t tell = 0;
-                while (tell < work.size) {
-                    size_t chunk = min(work.size - tell, static_cast<size_t>(4096));
-                    size_t written = write(work.file, (char*) work.data + tell, chunk);
-                    if (written == -1) break;
-                    tell += written;
+        // Whether a frame fits in the private pipes, created and grown on demand. All
+        // channels share a budget of pipe memory, the kernel shrinks every later pipe
+        // of the user past its soft limit, the ones written to included
+        bool fits(size_t bytes) {
+            while (total < bytes && pipes.size() < PIPES) {
+                size_t left = budget() - min(budget(), reserved.load());
+                if (left < Pool::ALIGN * 16)
+                    break;
+                Pipe pipe;
+                if (pipe2(pipe.ends, O_CLOEXEC) != 0)
+                    break;
+                pipe.capacity = pipesize(pipe.ends[1], (long) min(left, largest()));
+                pipes.push_back(pipe);
+                total += pipe.capacity;
+                reserved.fetch_add(pipe.capacity);
+
+                // Past the user's soft limit of pipe pages, new ones only get a page
+                if (pipe.capacity < Pool::ALIGN * 16)
+                    break;
+            }
+            return (bytes <= total);
+        }
+
+        // Write a frame count times, returns the errno of a failure
+        int repeat(int file, const vector<iovec>& frame, size_t count, Stats* stats) {
+            size_t bytes = 0;
+            for (const iovec& buffer: frame)
+                bytes += buffer.iov_len;
+
+            // The pipes are empty and large enough, this never blocks
+            vector<size_t> lengths;
+            for (size_t index=0, offset=0; offset<bytes; index++) {
+                size_t length = min(pipes[index].capacity, bytes - offset);
+                vector<iovec> piece = slice(frame, offset, length);
+                Chunk whole(length);
+                if (int error = writeall(pipes[index].ends[1], piece, whole))
+                    return fail(error);
+                lengths.push_back(length);
+                offset += length;
+            }
+
+            for (size_t time=1; time<=count; time++) {
+                bool last = (time == count);
+                for (size_t index=0, offset=0; index<lengths.size(); offset+=lengths[index++]) {
+                    int source = pipes[index].ends[0];
+                    size_t length = lengths[index];
+                    size_t done = 0;
+                    while (done < length) {
+                        ssize_t moved = (last
+                            ? splice(source, nullptr, file, nullptr, length - done, SPLICE_F_MOVE)
+                            : ::tee(source, file, length, 0));
+                        if (moved < 0) {
+                            if (errno == EINTR)
+                                continue;
+                            if (errno == EAGAIN) {
+                                pollfd ready = {file, POLLOUT, 0};
+                                poll(&ready, 1, -1);
+                                continue;
+                            }
+                            return fail(errno);
+                        }
+                        if (stats != nullptr)
+                            stats->write(length - done, moved);
+                        done += moved;
+
+                        // Tee always starts from the pipe's head, the rest comes from memory
+                        if (!last && done < length) {
+                            vector<iovec> rest = slice(frame, offset + done, length - done);
+                            Chunk chunk(0);
+                            if (int error = writeall(file, rest, chunk, Method::Write, nullptr, stats))
+                                return fail(error);
+                            done = length;
+                        }
+                    }
                 }
-            #endif
+            }
 
-            lock.lock();
+            // Only a single pipe waits for the next frame, large ones are rare
+            shrink(1);
+            return 0;
+        }
 
-            /* Signal work is done */ {
-                pending[file][work.data].notify_all();
-                queue[file].erase(work.data);
-                signal.notify_all();
+    private:
+        struct Pipe {int ends[2] = {-1, -1}; size_t capacity = 0;};
+        vector<Pipe> pipes;
+        size_t total = 0;
+
+        // Bytes in the private pipes of all channels
+        static atomic<size_t> reserved;
+
+        // A quarter of the user's soft limit of pipe pages, which other processes share
+        static size_t budget() {
+            static const long pages = setting("/proc/sys/fs/pipe-user-pages-soft");
+            if (pages <= 0)
+                return (16 << 20);
+            return ((size_t) pages * (size_t) sysconf(_SC_PAGESIZE) / 4);
+        }
+
+        // Unprivileged processes can grow a pipe up to this size
+        static size_t largest() {
+            static const long bytes = setting("/proc/sys/fs/pipe-max-size");
+            return (bytes > 0 ? (size_t) bytes : (1 << 20));
+        }
+
+        static long setting(const char* path) {
+            long value = 0;
+            FILE* proc = fopen(path, "r");
+            if (proc != nullptr) {
+                if (fscanf(proc, "%ld", &value) != 1)
+                    value = 0;
+                fclose(proc);
             }
+            return value;
         }
-    }
+
+        // Close the pipes past the first ones, their memory goes back to the budget
+        void shrink(size_t keep) {
+            while (pipes.size() > keep) {
+                Pipe& pipe = pipes.back();
+                for (int end: pipe.ends)
+                    ::close(end);
+                total -= pipe.capacity;
+                reserved.fetch_sub(pipe.capacity);
+                pipes.pop_back();
+            }
+        }
+
+        void close() {shrink(0);}
+
+        // Whatever is left in the pipes is stale, start over next time
+        int fail(int error) {
+            close();
+            return error;
+        }
+
+        // Some bytes of the buffers from an offset in them
+        static vector<iovec> slice(const vector<iovec>& frame, size_t offset, size_t bytes) {
+            vector<iovec> piece;
+            for (const iovec& buffer: frame) {
+                if (bytes == 0)
+                    break;
+                if (offset >= buffer.iov_len) {
+                    offset -= buffer.iov_len;
+                    continue;
+                }
+                size_t length = min(buffer.iov_len - offset, bytes);
+                piece.push_back({(char*) buffer.iov_base + offset, length});
+                bytes -= length;
+                offset = 0;
+            }
+            return piece;
+        }
+    };
+
+    #endif
+
+    #ifdef TURBOPIPE_URING
+
+    // A single thread submitting the writes of many channels to an io_uring, a
+    // vectored write in flight per file descriptor to keep its frames in order.
+    // Raw syscalls, the ring buffers are shared memory with the kernel
+    class Uring {
+    public:
+        static constexpr unsigned ENTRIES = 256;
+
+        Uring() {
+            io_uring_params params = {};
+            file = (int) syscall(__NR_io_uring_setup, ENTRIES, &params);
+            if (file < 0)
+                return;
+
+            // Writes at the current position of files, pipes and sockets have none
+            if (!(params.features & IORING_FEAT_RW_CUR_POS) || !map(params)) {
+                ::close(file);
+                file = -1;
+                return;
+            }
+            doorbell = eventfd(0, EFD_CLOEXEC);
+            if (doorbell < 0) {
+                ::close(file);
+                file = -1;
+                return;
+            }
+            engine = thread(&Uring::run, this);
+        }
+
+        ~Uring() {
+            if (file < 0)
+                return;
+            running.store(false);
+            uint64_t one = 1;
+            ssize_t ignored = ::write(doorbell, &one, sizeof(one));
+            (void) ignored;
+            engine.join();
+            for (auto& region: regions)
+                munmap(region.first, region.second);
+            ::close(doorbell);
+            ::close(file);
+        }
+
+        // Write a channel from now on, false if io_uring isn't usable
+        bool attach(Channel* channel) {
+            if (file < 0)
+                return false;
+            channel->options.splice = false;
+            channel->options.zerocopy = false;
+            channel->armed = &armed;
+            {
+                lock_guard<mutex> lock(this->lock);
+                states.emplace_back(new State());
+                states.back()->channel = channel;
+                channel->doorbell = doorbell;
+            }
+            armed.store(false);
+            uint64_t one = 1;
+            ssize_t ignored = ::write(doorbell, &one, sizeof(one));
+            (void) ignored;
+            return true;
+        }
+
+        // A drained channel is no longer written, nothing of it is in flight
+        void detach(Channel* channel) {
+            lock_guard<mutex> lock(this->lock);
+            for (size_t index=0; index<states.size(); index++) {
+                if (states[index]->channel == channel) {
+                    states.erase(states.begin() + index);
+                    break;
+                }
+            }
+        }
+
+    private:
+        struct State {
+            Channel* channel = nullptr;
+            deque<Work> backlog;    // Taken from the channel, not yet submitted
+            vector<Work> flight;    // Written by the submitted write
+            vector<iovec> iov;      // Whatever is left of the flight
+            size_t first = 0;       // Next buffer of iov to be written
+            msghdr message = {};    // Sockets are sent without SIGPIPE
+            vector<uint8_t> scratch;
+            bool busy = false;
+            bool stalled = false;   // No free submission entry, retried after reaping
+        };
+
+        int file = -1;
+        int doorbell = -1;
+        uint64_t rung = 0;
+        atomic<bool> armed{false};
+        atomic<bool> running{true};
+        vector<unique_ptr<State>> states;
+        vector<pair<void*, size_t>> regions;
+        thread engine;
+        mutex lock;
+
+        // Submission and completion rings
+        unsigned *sqhead, *sqtail, *sqmask, *sqentries, *sqarray;
+        unsigned *cqhead, *cqtail, *cqmask;
+        io_uring_sqe* sqes;
+        io_uring_cqe* cqes;
+        unsigned submitting = 0;
+        bool listening = false;  // The doorbell read is submitted, retried while the queue is full
+
+        bool map(const io_uring_params& params) {
+            size_t sqsize = (params.sq_off.array + params.sq_entries * sizeof(unsigned));
+            size_t cqsize = (params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+            bool single = (params.features & IORING_FEAT_SINGLE_MMAP);
+            if (single)
+                sqsize = cqsize = max(sqsize, cqsize);
+
+            char* sq = (char*) region(sqsize, IORING_OFF_SQ_RING);
+            char* cq = (single ? sq : (char*) region(cqsize, IORING_OFF_CQ_RING));
+            sqes = (io_uring_sqe*) region(params.sq_entries * sizeof(io_uring_sqe), IORING_OFF_SQES);
+            if (sq == nullptr || cq == nullptr || sqes == nullptr)
+                return false;
+
+            sqhead    = (unsigned*) (sq + params.sq_off.head);
+            sqtail    = (unsigned*) (sq + params.sq_off.tail);
+            sqmask    = (unsigned*) (sq + params.sq_off.ring_mask);
+            sqentries = (unsigned*) (sq + params.sq_off.ring_entries);
+            sqarray   = (unsigned*) (sq + params.sq_off.array);
+            cqhead    = (unsigned*) (cq + params.cq_off.head);
+            cqtail    = (unsigned*) (cq + params.cq_off.tail);
+            cqmask    = (unsigned*) (cq + params.cq_off.ring_mask);
+            cqes      = (io_uring_cqe*) (cq + params.cq_off.cqes);
+            return true;
+        }
+
+        void* region(size_t size, off_t offset) {
+            void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, file, offset);
+            if (memory == MAP_FAILED)
+                return nullptr;
+            regions.push_back({memory, size});
+            return memory;
+        }
+
+        // Next free submission entry, flushing them to the kernel when full
+        io_uring_sqe* entry() {
+            unsigned tail = *sqtail;
+            if ((tail - __atomic_load_n(sqhead, __ATOMIC_ACQUIRE)) >= *sqentries) {
+                enter(0);
+                if ((tail - __atomic_load_n(sqhead, __ATOMIC_ACQUIRE)) >= *sqentries)
+                    return nullptr;
+            }
+            unsigned index = (tail & *sqmask);
+            sqarray[index] = index;
+            io_uring_sqe* sqe = &sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            __atomic_store_n(sqtail, tail + 1, __ATOMIC_RELEASE);
+            submitting++;
+            return sqe;
+        }
+
+        void enter(unsigned wait) {
+            while (true) {
+                long entered = syscall(__NR_io_uring_enter, file, submitting, wait, IORING_ENTER_GETEVENTS, nullptr, 0);
+                if (entered >= 0) {
+                    submitting -= min(submitting, (unsigned) entered);
+                    return;
+                }
+
+                // Out of resources or completions, reaping makes room
+                if (errno != EINTR)
+                    return;
+            }
+        }
+
+        // The doorbell is a read of the eventfd, completing when any channel has work
+        void listen() {
+            if (io_uring_sqe* sqe = entry()) {
+                listening = true;
+                sqe->opcode = IORING_OP_READ;
+                sqe->fd = doorbell;
+                sqe->addr = (uint64_t) &rung;
+                sqe->len = sizeof(rung);
+                sqe->user_data = 0;
+            }
+        }
+
+        void run() {
+            listen();
+            while (running.load()) {
+                armed.store(true);
+                bool submitted = false;
+                {
+                    lock_guard<mutex> lock(this->lock);
+                    for (auto& state: states)
+                        submitted |= (state->stalled ? submit(*state) : fill(*state));
+                }
+                if (!listening)
+                    listen();
+                enter(submitted ? 0 : 1);
+                reap();
+            }
+        }
+
+        // Submit the next write of an idle channel, true if any
+        bool fill(State& state) {
+            Channel* channel = state.channel;
+            if (state.busy)
+                return false;
+            if (state.backlog.empty()) {
+                vector<Work> batch;
+                if (!channel->take(batch))
+                    return false;
+                for (Work& work: batch)
+                    state.backlog.push_back(move(work));
+            }
+
+            // Discard all work after an error, no one is reading it
+            if (channel->error.load()) {
+                vector<Work> discard(state.backlog.begin(), state.backlog.end());
+                state.backlog.clear();
+                channel->done(discard);
+                return false;
+            }
+
+            // Scratch memory is reused, later work waits for this write
+            state.iov.clear();
+            state.first = 0;
+            bool scratched = false;
+            while (!state.backlog.empty()) {
+                Work& work = state.backlog.front();
+                if (work.into != Format::None && scratched)
+                    break;
+                char* data = (char*) prepare(work, state.scratch);
+                scratched |= (data == (char*) state.scratch.data());
+                size_t bytes = size(work);
+                size_t begin = state.iov.size();
+                if (flipped(work)) {
+                    size_t stride = (bytes / work.height);
+                    for (size_t row=work.height; row-- > 0;)
+                        state.iov.push_back({data + row * stride, stride});
+                } else {
+                    state.iov.push_back({data, bytes});
+                }
+                repeat(state.iov, begin, work.repeat);
+                state.flight.push_back(move(work));
+                state.backlog.pop_front();
+            }
+            return submit(state);
+        }
+
+        // Write what's left of the flight, at most IOV_MAX buffers at once. A full
+        // submission queue is only backpressure, the flight stays busy until retried
+        bool submit(State& state) {
+            io_uring_sqe* sqe = entry();
+            state.busy = true;
+            state.stalled = (sqe == nullptr);
+            if (sqe == nullptr)
+                return false;
+            unsigned count = (unsigned) min((size_t) IOV_MAX, state.iov.size() - state.first);
+            sqe->fd = state.flight[0].file;
+            sqe->user_data = (uint64_t) &state;
+            if (state.channel->socket) {
+                state.message = {};
+                state.message.msg_iov = &state.iov[state.first];
+                state.message.msg_iovlen = count;
+                sqe->opcode = IORING_OP_SENDMSG;
+                sqe->addr = (uint64_t) &state.message;
+                sqe->len = 1;
+                sqe->msg_flags = MSG_NOSIGNAL;
+            } else {
+                sqe->opcode = IORING_OP_WRITEV;
+                sqe->addr = (uint64_t) &state.iov[state.first];
+                sqe->len = count;
+                sqe->off = (uint64_t) -1;
+            }
+            state.busy = true;
+            return true;
+        }
+
+        // The flight is written or failed, hand it back to the producers
+        void finish(State& state, int error) {
+            if (error)
+                state.channel->error.store(error);
+            state.channel->done(state.flight);
+            state.busy = false;
+        }
+
+        void reap() {
+            lock_guard<mutex> lock(this->lock);
+            unsigned head = *cqhead;
+            while (head != __atomic_load_n(cqtail, __ATOMIC_ACQUIRE)) {
+                io_uring_cqe* cqe = &cqes[head & *cqmask];
+                int result = cqe->res;
+                State* state = (State*) cqe->user_data;
+                __atomic_store_n(cqhead, ++head, __ATOMIC_RELEASE);
+
+                if (state == nullptr) {
+                    listening = false;
+                    continue;
+                }
+                if (result < 0) {
+                    if (result == -EINTR || result == -EAGAIN)
+                        submit(*state);
+                    else
+                        finish(*state, -result);
+                    continue;
+                }
+
+                // Skip fully written buffers, advance partial ones
+                size_t left = result;
+                vector<iovec>& iov = state->iov;
+                if (TURBOPIPE_STATS) {
+                    size_t requested = 0;
+                    for (size_t index=state->first; index<iov.size(); index++)
+                        requested += iov[index].iov_len;
+                    state->channel->stats.write(requested, left);
+                }
+                while (state->first < iov.size() && left >= iov[state->first].iov_len)
+                    left -= iov[state->first++].iov_len;
+                if (left > 0) {
+                    iov[state->first].iov_base = (char*) iov[state->first].iov_base + left;
+                    iov[state->first].iov_len -= left;
+                }
+                if (state->first < iov.size())
+                    submit(*state);
+                else
+                    finish(*state, 0);
+            }
+            if (!listening)
+                listen();
+        }
+    };
+
+    #endif
+};
+
+constexpr int TurboPipe::PATHS;
+#ifdef __linux__
+constexpr size_t TurboPipe::Tee::PIPES;
+atomic<size_t> TurboPipe::Tee::reserved{0};
+#endif
+#ifdef TURBOPIPE_URING
+constexpr unsigned TurboPipe::Uring::ENTRIES;
+#endif
+
+#ifndef TURBOPIPE_NO_PYTHON
+
+// Used by the module functions, and every instance alive for shutting down
+static TurboPipe* fallback = nullptr;
+static unordered_set<TurboPipe*> instances;
+static mutex living;
+
+// An independent TurboPipe with its own workers, options and stats
+struct PipeObject {
+    PyObject_HEAD
+    TurboPipe* turbopipe;
 };
 
-// The main and only instance of TurboPipe
-static TurboPipe* turbopipe = nullptr;
+static PyTypeObject* PipeType = nullptr;
+
+// The instance methods are called on, the default one for module functions
+static TurboPipe* instance(PyObject* self) {
+    if (self != NULL && PipeType != nullptr && PyObject_TypeCheck(self, PipeType))
+        return ((PipeObject*) self)->turbopipe;
+    return fallback;
+}
 
 // ------------------------------------------------------------------------------------------------|
 // End user methods
 
+// Raise the errno of a failed write as the matching OSError
+static PyObject* turbopipe_error(int error) {
+    errno = error;
+    return PyErr_SetFromErrno(PyExc_OSError);
+}
+
 static PyObject* turbopipe_pipe(
-    PyObject* Py_UNUSED(self),
-    PyObject* args
+    PyObject* self,
+    PyObject* args,
+    PyObject* kwargs
 ) {
+    TurboPipe* turbopipe = instance(self);
+    static const char* keywords[] = {
+        "view", "file", "copy", "convert", "width", "height", "flip", "track", "repeat", "offset", "path", "pts", "hold", NULL
+    };
     PyObject* view;
     PyObject* file;
-    if (!PyArg_ParseTuple(args, "OO", &view, &file))
+    int copy = 0;
+    const char* conversion = nullptr;
+    unsigned int width = 0;
+    unsigned int height = 0;
+    int flip = 0;
+    int track = 0;
+    Py_ssize_t repeat = 1;
+    long long offset = -1;
+    const char* path = nullptr;
+    long long pts = -1;
+    int hold = 1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|pzIIppnLzLp", (char**) keywords,
+        &view, &file, &copy, &conversion, &width, &height, &flip, &track, &repeat, &offset, &path, &pts, &hold))
+        return NULL;
+
+    // Any contiguous exporter, held until written unless the caller manages it, as
+    // OpenGL mappings that must be released by the thread owning the context
+    Py_buffer* buffer = new Py_buffer;
+    if (PyObject_GetBuffer(view, buffer, PyBUF_SIMPLE) < 0) {
+        delete buffer;
+        return NULL;
+    }
+    shared_ptr<void> held = TurboPipe::hold(buffer);
+    size_t length = buffer->len;
+
+    // Conversions as "from->into" pixel formats
+    Work work;
+    if (conversion != nullptr) {
+        const char* arrow = strstr(conversion, "->");
+        if (arrow != nullptr) {
+            string from(conversion, arrow - conversion);
+            work.from = format(from.c_str());
+            work.into = format(arrow + 2);
+        }
+        if (converted(work.from, work.into, width, height) == 0) {
+            PyErr_Format(PyExc_ValueError, "Unsupported conversion '%s' of %ux%u", conversion, width, height);
+            return NULL;
+        }
+        size_t bpp = (work.from == Format::RGBA ? 4 : 3);
+        if (length < (size_t) width * height * bpp) {
+            PyErr_Format(PyExc_ValueError, "Buffer too small for a %ux%u frame", width, height);
+            return NULL;
+        }
+    }
+
+    // Framed headers carry the size even without conversions
+    work.width  = width;
+    work.height = height;
+    work.pts = pts;
+
+    // Rows are the buffer split evenly in height parts
+    if (flip) {
+        if (height == 0 || (conversion == nullptr && length % height != 0)) {
+            PyErr_Format(PyExc_ValueError, "Can't flip %zu bytes in %u rows", length, height);
+            return NULL;
+        }
+        work.flip = true;
+    }
+
+    if (repeat < 1) {
+        PyErr_Format(PyExc_ValueError, "Can't repeat a frame %zd times", repeat);
+        return NULL;
+    }
+    work.repeat = repeat;
+
+    // Positional writes, paths all share a channel
+    work.offset = offset;
+    if (path != nullptr) {
+        if (*path == '\0') {
+            PyErr_SetString(PyExc_ValueError, "Empty path");
+            return NULL;
+        }
+        work.path = path;
+    }
+
+    // Either a single file descriptor or a sequence of them
+    vector<int> files;
+    if (path != nullptr) {
+        files.push_back(TurboPipe::PATHS);
+    } else if (PyLong_Check(file)) {
+        files.push_back(PyLong_AsLong(file));
+    } else {
+        PyObject* sequence = PySequence_Fast(file, "Expected a file descriptor or a sequence of them");
+        if (sequence == NULL)
+            return NULL;
+        for (Py_ssize_t index=0; index<PySequence_Fast_GET_SIZE(sequence); index++)
+            files.push_back(PyLong_AsLong(PySequence_Fast_GET_ITEM(sequence, index)));
+        Py_DECREF(sequence);
+    }
+    if (PyErr_Occurred())
         return NULL;
-    if (!PyMemoryView_Check(view)) {
-        PyErr_SetString(PyExc_TypeError, "Expected a memoryview object");
+
+    // Framing mistakes are the caller's, not failed writes
+    const char* refusal;
+    work.size = length;
+    Py_BEGIN_ALLOW_THREADS
+    refusal = turbopipe->refused(work, files);
+    Py_END_ALLOW_THREADS
+    if (refusal != nullptr) {
+        PyErr_SetString(PyExc_ValueError, refusal);
         return NULL;
     }
-    turbopipe->pipe(view, PyLong_AsLong(file));
+
+    // Tracked pipes return a ticket, see completed()
+    uint64_t ticket = 0;
+    if (int error = turbopipe->pipe(held, files, copy, work, (track ? &ticket : nullptr), hold))
+        return turbopipe_error(error);
+    if (track)
+        return PyLong_FromUnsignedLongLong(ticket);
     Py_RETURN_NONE;
 }
 
+// File descriptor readable while tracked pipes completed, -1 if unsupported
+static PyObject* turbopipe_notifier(
+    PyObject* self,
+    PyObject* Py_UNUSED(args)
+) {
+    TurboPipe* turbopipe = instance(self);
+    return PyLong_FromLong(turbopipe->notifier.file());
+}
+
+// List of (ticket, errno) of the tracked pipes completed since the last call
+static PyObject* turbopipe_completed(
+    PyObject* self,
+    PyObject* Py_UNUSED(args)
+) {
+    TurboPipe* turbopipe = instance(self);
+    vector<Notifier::Done> done = turbopipe->notifier.drain();
+    PyObject* list = PyList_New(done.size());
+    if (list == NULL)
+        return NULL;
+    for (size_t index=0; index<done.size(); index++) {
+        PyObject* item = Py_BuildValue("(Ki)", (unsigned long long) done[index].ticket, done[index].error);
+        if (item == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, index, item);
+    }
+    return list;
+}
+
+// Counters of every file descriptor piped to, keyed by it
+static PyObject* turbopipe_stats(
+    PyObject* self,
+    PyObject* Py_UNUSED(args)
+) {
+    TurboPipe* turbopipe = instance(self);
+    struct Snapshot {
+        int file;
+        uint64_t bytes, frames, blocked, writes, partial, dropped;
+        size_t depth, queued;
+        uint64_t latency[Stats::BUCKETS];
+    };
+
+    // Workers might wait for the GIL to release buffers while holding the registry
+    vector<Snapshot> snapshots;
+    Py_BEGIN_ALLOW_THREADS
+    for (auto& pair: turbopipe->active()) {
+        Channel& channel = *pair.second;
+        Snapshot snapshot = {pair.first,
+            channel.stats.bytes.load(), channel.stats.frames.load(), channel.stats.blocked.load(),
+            channel.stats.writes.load(), channel.stats.partial.load(), channel.stats.dropped.load(),
+            channel.depth(), channel.bytes.load(), {}};
+        for (size_t bucket=0; bucket<Stats::BUCKETS; bucket++)
+            snapshot.latency[bucket] = channel.stats.latency[bucket].load();
+        snapshots.push_back(snapshot);
+    }
+    Py_END_ALLOW_THREADS
+
+    PyObject* stats = PyDict_New();
+    if (stats == NULL)
+        return NULL;
+
+    for (const Snapshot& snapshot: snapshots) {
+        PyObject* latency = PyList_New(Stats::BUCKETS);
+        if (latency == NULL) {
+            Py_DECREF(stats);
+            return NULL;
+        }
+        for (size_t bucket=0; bucket<Stats::BUCKETS; bucket++)
+            PyList_SET_ITEM(latency, bucket, PyLong_FromUnsignedLongLong(snapshot.latency[bucket]));
+
+        PyObject* entry = Py_BuildValue("{s:K,s:K,s:n,s:n,s:d,s:K,s:K,s:K,s:N}",
+            "bytes",   (unsigned long long) snapshot.bytes,
+            "frames",  (unsigned long long) snapshot.frames,
+            "depth",   (Py_ssize_t) snapshot.depth,
+            "queued",  (Py_ssize_t) snapshot.queued,
+            "blocked", (snapshot.blocked / 1e9),
+            "writes",  (unsigned long long) snapshot.writes,
+            "partial", (unsigned long long) snapshot.partial,
+            "dropped", (unsigned long long) snapshot.dropped,
+            "latency", latency
+        );
+        PyObject* file = PyLong_FromLong(snapshot.file);
+        if (entry == NULL || file == NULL || PyDict_SetItem(stats, file, entry) < 0) {
+            Py_XDECREF(entry);
+            Py_XDECREF(file);
+            Py_DECREF(stats);
+            return NULL;
+        }
+        Py_DECREF(entry);
+        Py_DECREF(file);
+    }
+    return stats;
+}
+
 static PyObject* turbopipe_sync(
-    PyObject* Py_UNUSED(self),
+    PyObject* self,
     PyObject* args
 ) {
-    PyObject* view;
+    TurboPipe* turbopipe = instance(self);
+    PyObject* view = nullptr;
     if (!PyArg_ParseTuple(args, "|O", &view))
         return NULL;
-    if (view != nullptr && !PyMemoryView_Check(view)) {
-        PyErr_SetString(PyExc_TypeError, "Expected a memoryview object or None");
+    if (view == Py_None)
+        view = nullptr;
+
+    // Negative when not a buffer, with the exception set
+    int error = turbopipe->sync(view);
+    if (error < 0)
         return NULL;
-    }
-    turbopipe->sync(view);
+    if (error)
+        return turbopipe_error(error);
     Py_RETURN_NONE;
 }
 
+// Dictionary of the effective options of a channel
+static PyObject* turbopipe_options(Options options) {
+    PyObject* cpus = PyList_New(options.cpus.size());
+    if (cpus == NULL)
+        return NULL;
+    for (size_t index=0; index<options.cpus.size(); index++)
+        PyList_SET_ITEM(cpus, index, PyLong_FromLong(options.cpus[index]));
+
+    return Py_BuildValue("{s:n,s:n,s:n,s:l,s:O,s:n,s:n,s:n,s:n,s:s,s:i,s:n,s:O,s:l,s:O,s:O,s:N,s:i,s:O,s:s,s:n,s:O,s:s,s:(II)}",
+        "ring",     (Py_ssize_t) options.ring,
+        "chunk",    (Py_ssize_t) options.chunk,
+        "iovecs",   (Py_ssize_t) options.iovecs,
+        "pipesize", options.pipesize,
+        "splice",   options.splice ? Py_True : Py_False,
+        "depth",    (Py_ssize_t) options.depth,
+        "memory",   (Py_ssize_t) options.memory,
+        "staging",  (Py_ssize_t) options.staging,
+        "copiers",  (Py_ssize_t) options.copiers,
+        "compress", codec(options.compress),
+        "level",    options.level,
+        "compressors", (Py_ssize_t) options.compressors,
+        "nodelay",  options.nodelay ? Py_True : Py_False,
+        "sndbuf",   options.sndbuf,
+        "zerocopy", options.zerocopy ? Py_True : Py_False,
+        "uring",    options.uring ? Py_True : Py_False,
+        "cpus",     cpus,
+        "priority", options.priority,
+        "hugepages", options.hugepages ? Py_True : Py_False,
+        "policy",   policy(options.policy),
+        "writers",  (Py_ssize_t) options.writers,
+        "direct",   options.direct ? Py_True : Py_False,
+        "framing",  framing(options.framing),
+        "fps",      (unsigned int) options.rate[0], (unsigned int) options.rate[1]
+    );
+}
+
+static PyObject* turbopipe_configure(
+    PyObject* self,
+    PyObject* args,
+    PyObject* kwargs
+) {
+    TurboPipe* turbopipe = instance(self);
+    int file;
+    if (!PyArg_ParseTuple(args, "i", &file))
+        return NULL;
+
+    // Only override the options that were given
+    Options options;
+    Py_BEGIN_ALLOW_THREADS
+    options = turbopipe->options(file);
+    Py_END_ALLOW_THREADS
+    PyObject* key;
+    PyObject* value;
+    Py_ssize_t index = 0;
+    while (kwargs != nullptr && PyDict_Next(kwargs, &index, &key, &value)) {
+        const char* name = PyUnicode_AsUTF8(key);
+        if (name == nullptr)
+            return NULL;
+        if (value == Py_None)
+            continue;
+        if (strcmp(name, "ring") == 0) {
+            options.ring = PyLong_AsSize_t(value);
+        } else if (strcmp(name, "chunk") == 0) {
+            options.chunk = PyLong_AsSize_t(value);
+        } else if (strcmp(name, "iovecs") == 0) {
+            options.iovecs = PyLong_AsSize_t(value);
+        } else if (strcmp(name, "pipesize") == 0) {
+            options.pipesize = PyLong_AsLong(value);
+        } else if (strcmp(name, "splice") == 0) {
+            options.splice = PyObject_IsTrue(value);
+        } else if (strcmp(name, "depth") == 0) {
+            options.depth = PyLong_AsSize_t(value);
+        } else if (strcmp(name, "memory") == 0) {
+            options.memory = PyLong_AsSize_t(value);
+        } else if (strcmp(name, "staging") == 0) {
+            options.staging = PyLong_AsSize_t(value);
+        } else if (strcmp(name, "copiers") == 0) {
+            options.copiers = PyLong_AsSize_t(value);
+        } else if (strcmp(name, "compress") == 0) {
+            const char* compress = PyUnicode_AsUTF8(value);
+            if (compress == nullptr)
+                return NULL;
+            if (!codec(compress, options.compress)) {
+                PyErr_Format(PyExc_ValueError, "Unknown or unavailable codec '%s' in this build", compress);
+                return NULL;
+            }
+        } else if (strcmp(name, "level") == 0) {
+            options.level = (int) PyLong_AsLong(value);
+        } else if (strcmp(name, "compressors") == 0) {
+            options.compressors = PyLong_AsSize_t(value);
+        } else if (strcmp(name, "nodelay") == 0) {
+            options.nodelay = PyObject_IsTrue(value);
+        } else if (strcmp(name, "sndbuf") == 0) {
+            options.sndbuf = PyLong_AsLong(value);
+        } else if (strcmp(name, "zerocopy") == 0) {
+            options.zerocopy = PyObject_IsTrue(value);
+        } else if (strcmp(name, "uring") == 0) {
+            options.uring = PyObject_IsTrue(value);
+        } else if (strcmp(name, "cpus") == 0) {
+            PyObject* sequence = PySequence_Fast(value, "Expected a sequence of CPU numbers");
+            if (sequence == NULL)
+                return NULL;
+            options.cpus.clear();
+            for (Py_ssize_t item=0; item<PySequence_Fast_GET_SIZE(sequence); item++)
+                options.cpus.push_back((int) PyLong_AsLong(PySequence_Fast_GET_ITEM(sequence, item)));
+            Py_DECREF(sequence);
+        } else if (strcmp(name, "priority") == 0) {
+            options.priority = (int) PyLong_AsLong(value);
+        } else if (strcmp(name, "hugepages") == 0) {
+            options.hugepages = PyObject_IsTrue(value);
+        } else if (strcmp(name, "policy") == 0) {
+            const char* policy = PyUnicode_AsUTF8(value);
+            if (policy == nullptr)
+                return NULL;
+            if (!::policy(policy, options.policy)) {
+                PyErr_Format(PyExc_ValueError, "Unknown queue policy '%s'", policy);
+                return NULL;
+            }
+        } else if (strcmp(name, "writers") == 0) {
+            options.writers = PyLong_AsSize_t(value);
+        } else if (strcmp(name, "direct") == 0) {
+            options.direct = PyObject_IsTrue(value);
+        } else if (strcmp(name, "framing") == 0) {
+            const char* framing = PyUnicode_AsUTF8(value);
+            if (framing == nullptr)
+                return NULL;
+            if (!::framing(framing, options.framing)) {
+                PyErr_Format(PyExc_ValueError, "Unknown framing '%s'", framing);
+                return NULL;
+            }
+        } else if (strcmp(name, "fps") == 0) {
+            unsigned int rate, base;
+            if (!PyArg_ParseTuple(value, "II", &rate, &base))
+                return NULL;
+            if (rate == 0 || base == 0) {
+                PyErr_Format(PyExc_ValueError, "Invalid frame rate %u/%u", rate, base);
+                return NULL;
+            }
+            options.rate[0] = rate;
+            options.rate[1] = base;
+        } else {
+            PyErr_Format(PyExc_TypeError, "Unknown option '%s'", name);
+            return NULL;
+        }
+        if (PyErr_Occurred())
+            return NULL;
+    }
+
+    if (options.framing == Framing::Y4M && options.compress != Codec::None) {
+        PyErr_SetString(PyExc_ValueError, "Y4M framing can't be compressed");
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    options = turbopipe->configure(file, options);
+    Py_END_ALLOW_THREADS
+    return turbopipe_options(options);
+}
+
 static PyObject* turbopipe_close(
-    PyObject* Py_UNUSED(self),
+    PyObject* self,
     PyObject* Py_UNUSED(args)
 ) {
+    TurboPipe* turbopipe = instance(self);
+    Py_BEGIN_ALLOW_THREADS
     turbopipe->close();
+    Py_END_ALLOW_THREADS
     Py_RETURN_NONE;
 }
 
 // ------------------------------------------------------------------------------------------------|
 // Python module definition
 
-static void turbopipe_exit() {
-    turbopipe->close();
+static PyObject* pipe_new(PyTypeObject* type, PyObject* Py_UNUSED(args), PyObject* Py_UNUSED(kwargs)) {
+    PipeObject* self = (PipeObject*) type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+    self->turbopipe = new TurboPipe();
+    lock_guard<mutex> lock(living);
+    instances.insert(self->turbopipe);
+    return (PyObject*) self;
+}
+
+static void pipe_dealloc(PipeObject* self) {
+    {
+        lock_guard<mutex> lock(living);
+        instances.erase(self->turbopipe);
+    }
+    Py_BEGIN_ALLOW_THREADS
+    delete self->turbopipe;
+    Py_END_ALLOW_THREADS
+    PyTypeObject* type = Py_TYPE(self);
+    type->tp_free((PyObject*) self);
+    Py_DECREF(type);
+}
+
+// Drain every instance before the interpreter finalizes, workers release buffers with the GIL
+static PyObject* turbopipe_exit(PyObject* Py_UNUSED(self), PyObject* Py_UNUSED(args)) {
+    vector<TurboPipe*> closing = {fallback};
+    {
+        lock_guard<mutex> lock(living);
+        closing.insert(closing.end(), instances.begin(), instances.end());
+    }
+    Py_BEGIN_ALLOW_THREADS
+    for (TurboPipe* turbopipe: closing)
+        turbopipe->close();
+    Py_END_ALLOW_THREADS
+    Py_RETURN_NONE;
 }
 
+static PyMethodDef TurboPipeExit = {"_exit", turbopipe_exit, METH_NOARGS, ""};
+
 static PyMethodDef TurboPipeMethods[] = {
-    {"pipe",  (PyCFunction) turbopipe_pipe,  METH_VARARGS, ""},
-    {"sync",  (PyCFunction) turbopipe_sync,  METH_VARARGS, ""},
-    {"close", (PyCFunction) turbopipe_close, METH_NOARGS,  ""},
+    {"pipe",      (PyCFunction) (void(*)(void)) turbopipe_pipe, METH_VARARGS | METH_KEYWORDS, ""},
+    {"sync",      (PyCFunction) turbopipe_sync,  METH_VARARGS, ""},
+    {"configure", (PyCFunction) (void(*)(void)) turbopipe_configure, METH_VARARGS | METH_KEYWORDS, ""},
+    {"close",     (PyCFunction) turbopipe_close, METH_NOARGS,  ""},
+    {"notifier",  (PyCFunction) turbopipe_notifier,  METH_NOARGS, ""},
+    {"completed", (PyCFunction) turbopipe_completed, METH_NOARGS, ""},
+    {"stats",     (PyCFunction) turbopipe_stats,     METH_NOARGS, ""},
     {NULL, NULL, 0, NULL}
 };
 
+static PyType_Slot PipeSlots[] = {
+    {Py_tp_new,     (void*) pipe_new},
+    {Py_tp_dealloc, (void*) pipe_dealloc},
+    {Py_tp_methods, (void*) TurboPipeMethods},
+    {0, NULL}
+};
+
+static PyType_Spec PipeSpec = {
+    "turbopipe._turbopipe.Pipe",
+    sizeof(PipeObject), 0,
+    Py_TPFLAGS_DEFAULT,
+    PipeSlots
+};
+
 static struct PyModuleDef turbopipe_module = {
     PyModuleDef_HEAD_INIT,
     "_turbopipe",
@@ -231,7 +3686,33 @@ PyMODINIT_FUNC PyInit__turbopipe(void) {
     PyObject* module = PyModule_Create(&turbopipe_module);
     if (module == NULL)
         return NULL;
-    turbopipe = new TurboPipe();
-    Py_AtExit(turbopipe_exit);
+
+    // Everything shared is behind the core's own locks
+    #ifdef Py_GIL_DISABLED
+        PyUnstable_Module_SetGIL(module, Py_MOD_GIL_NOT_USED);
+    #endif
+
+    PipeType = (PyTypeObject*) PyType_FromSpec(&PipeSpec);
+    if (PipeType == NULL || PyModule_AddObject(module, "Pipe", (PyObject*) PipeType) < 0) {
+        Py_XDECREF(PipeType);
+        Py_DECREF(module);
+        return NULL;
+    }
+    Py_INCREF(PipeType);
+    fallback = new TurboPipe();
+
+    // Drain before the interpreter finalizes, workers release buffers with the GIL
+    PyObject* atexit = PyImport_ImportModule("atexit");
+    PyObject* exit = PyCFunction_New(&TurboPipeExit, NULL);
+    PyObject* registered = ((atexit && exit) ? PyObject_CallMethod(atexit, "register", "O", exit) : NULL);
+    Py_XDECREF(atexit);
+    Py_XDECREF(exit);
+    if (registered == NULL) {
+        Py_DECREF(module);
+        return NULL;
+    }
+    Py_DECREF(registered);
     return module;
 }
+
+#endif // TURBOPIPE_NO_PYTHON